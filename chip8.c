@@ -0,0 +1,776 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+
+static const uint8_t fonts[NUM_FONTS][FONT_SIZE] = {
+    {
+        0b11110000,
+        0b10010000,
+        0b10010000,
+        0b10010000,
+        0b11110000,
+    },
+    {
+        0b00100000,
+        0b01100000,
+        0b00100000,
+        0b00100000,
+        0b01110000,
+    },
+    {
+        0b11110000,
+        0b00010000,
+        0b11110000,
+        0b10000000,
+        0b11110000,
+    },
+    {
+        0b11110000,
+        0b00010000,
+        0b11110000,
+        0b00010000,
+        0b11110000,
+    },
+    {
+        0b10010000,
+        0b10010000,
+        0b11110000,
+        0b00010000,
+        0b00010000,
+    },
+    {
+        0b11110000,
+        0b10000000,
+        0b11110000,
+        0b00010000,
+        0b11110000,
+    },
+    {
+        0b11110000,
+        0b10000000,
+        0b11110000,
+        0b10010000,
+        0b11110000,
+    },
+    {
+        0b11110000,
+        0b00010000,
+        0b00100000,
+        0b01000000,
+        0b01000000,
+    },
+    {
+        0b11110000,
+        0b10010000,
+        0b11110000,
+        0b10010000,
+        0b11110000,
+    },
+    {
+        0b11110000,
+        0b10010000,
+        0b11110000,
+        0b00010000,
+        0b11110000,
+    },
+    {
+        0b11110000,
+        0b10010000,
+        0b11110000,
+        0b10010000,
+        0b10010000,
+    },
+    {
+        0b11100000,
+        0b10010000,
+        0b11100000,
+        0b10010000,
+        0b11100000,
+    },
+    {
+        0b11110000,
+        0b10000000,
+        0b10000000,
+        0b10000000,
+        0b11110000,
+    },
+    {
+        0b11100000,
+        0b10010000,
+        0b10010000,
+        0b10010000,
+        0b11100000,
+    },
+    {
+        0b11110000,
+        0b10000000,
+        0b11110000,
+        0b10000000,
+        0b11110000,
+    },
+    {
+        0b11110000,
+        0b10000000,
+        0b11110000,
+        0b10000000,
+        0b10000000,
+    }
+};
+
+void InitCHIP8(Chip8* machine) {
+    assert(machine != NULL);
+    memset(machine, 0, sizeof(Chip8));
+    machine->pc = PROGRAM_START;  // End of reserved mem.
+    machine->cycles_per_frame = CYCLES_PER_FRAME;
+    machine->skip_idle_loops = true;
+    machine->quirks = QUIRKS_DEFAULT;
+    SeedRandom(machine, 0);
+    memcpy(machine->ram, fonts, NUM_FONTS * FONT_SIZE * sizeof(uint8_t));
+    return ;
+}
+
+bool LoadProgram(Chip8* machine, const uint8_t* data, size_t size) {
+    if (size > NUM_RAM - PROGRAM_START) {
+        return false;
+    }
+    memcpy(&machine->ram[PROGRAM_START], data, size);
+    return true;
+}
+
+void SeedRandom(Chip8* machine, uint32_t seed) {
+    // xorshift32 never leaves the zero state, so mix the seed into a nonzero one.
+    machine->rng = seed * 2654435761u ^ 0x9E3779B9u;
+    if (machine->rng == 0) {
+        machine->rng = 1;
+    }
+    return ;
+}
+
+static uint8_t NextRandom(Chip8* machine) {
+    uint32_t x = machine->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    machine->rng = x;
+    return x >> 24;
+}
+
+static void EmitEvent(EventRing* ring, Event event) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ring->capacity) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return ;
+    }
+    event.frame = atomic_load_explicit(&ring->frame, memory_order_relaxed);
+    ring->records[head & (ring->capacity - 1)] = event;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return ;
+}
+
+// Emits an EVENT_RAM for every byte changed since the previous frame, comparing eight bytes
+// at a time since most of ram is untouched.
+static void EmitRamChanges(EventRing* ring, const uint8_t* ram) {
+    for (uint16_t addr = 0; addr < NUM_RAM; addr += 8) {
+        if (memcmp(&ram[addr], &ring->ram[addr], 8) == 0) {
+            continue;
+        }
+        for (uint16_t i = addr; i < addr + 8; ++i) {
+            if (ram[i] != ring->ram[i]) {
+                EmitEvent(ring, (Event){.type = EVENT_RAM, .value = ram[i], .addr = i});
+                ring->ram[i] = ram[i];
+            }
+        }
+    }
+    return ;
+}
+
+static Fault RaiseFault(Chip8* machine, Fault fault) {
+    machine->fault = fault;
+    return fault;
+}
+
+// The instruction decoder shared by EmulateCycle and RunCycles. It is inlined into both so
+// that running a batch of instructions costs no call per instruction.
+static inline Fault ExecuteInstruction(Chip8* machine) {
+    // CHIP-8 instructions are big endian encoded.
+    uint16_t instruction = machine->ram[(machine->pc + 1) & ADDR_MASK] << 0 | machine->ram[machine->pc & ADDR_MASK] << 8;
+    DPRINT("pc: %d; instruction: 0x%04" PRIx16 "\n", machine->pc, instruction);
+    switch (instruction & 0xF000) {
+        case 0x0000: {
+            switch (instruction) {
+                case 0x00E0: {
+                    memset(machine->logical_pixels, 0, DISPLAY_BYTES);
+                    machine->events |= RUN_DRAW;
+                    machine->pc += 2;
+                    DPRINT("CLS\n");
+                    break;
+                }
+                case 0x00EE: {
+                    // TODO: Is this the right order of operations?
+                    if (machine->sp == 0) {
+                        return RaiseFault(machine, FAULT_STACK_UNDERFLOW);
+                    }
+                    --machine->sp;
+                    machine->pc = machine->stack[machine->sp] + 2;  // Need to increment so I'm not stuck in an infinite loop?
+                    DPRINT("RET\n");
+                    break;
+                }
+                default: {
+                    // SYS calls into host machine code, which we cannot run.
+                    uint16_t addr = instruction & 0x0FFF;
+                    DPRINT("SYS %d\n", addr);
+                    return RaiseFault(machine, FAULT_ILLEGAL_OPCODE);
+                }
+            }
+            break;
+        }
+        case 0x1000: {
+            uint16_t addr = instruction & 0x0FFF;
+            // Jumping back over at most two instructions may close a busy-wait loop.
+            if ((uint16_t)(machine->pc - addr) <= 4) {
+                machine->events |= RUN_IDLE_LOOP;
+            }
+            machine->pc = addr;
+            DPRINT("JP %d\n", addr);
+            break;
+        }
+        case 0x2000: {
+            // TODO: Is this the right order of operations?
+            uint16_t addr = instruction & 0x0FFF;
+            if (machine->sp == NUM_STACK) {
+                return RaiseFault(machine, FAULT_STACK_OVERFLOW);
+            }
+            machine->stack[machine->sp] = machine->pc;
+            ++machine->sp;
+            machine->pc = addr;
+            DPRINT("CALL %d\n", addr);
+            break;
+        }
+        case 0x3000: {
+            uint8_t reg = (instruction & 0x0F00) >> 8;
+            uint8_t val = instruction & 0x00FF;
+            machine->pc += machine->registers[reg] == val ? 4 : 2;
+            DPRINT("SE V%d, %d\n", reg, val);
+            break;
+        }
+        case 0x4000: {
+            uint8_t reg = (instruction & 0x0F00) >> 8;
+            uint8_t val = instruction & 0x00FF;
+            machine->pc += machine->registers[reg] != val ? 4 : 2;
+            DPRINT("SNE V%d, %d\n", reg, val);
+            break;
+        }
+        case 0x5000: {
+            uint8_t lreg = (instruction & 0x0F00) >> 8;
+            uint8_t rreg = (instruction & 0x00F0) >> 4;
+            machine->pc += machine->registers[lreg] == machine->registers[rreg] ? 4 : 2;
+            DPRINT("SE V%d, V%d\n", lreg, rreg);
+            break;
+        }
+        case 0x6000: {
+            uint8_t reg = (instruction & 0x0F00) >> 8;
+            uint8_t val = instruction & 0x00FF;
+            machine->registers[reg] = val;
+            machine->pc += 2;
+            DPRINT("LD V%d, %d\n", reg, val);
+            break;
+        }
+        case 0x7000: {
+            uint8_t reg = (instruction & 0x0F00) >> 8;
+            uint8_t val = instruction & 0x00FF;
+            machine->registers[reg] += val;
+            machine->pc += 2;
+            DPRINT("ADD V%d, %d\n", reg, val);
+            break;
+        }
+        case 0x8000: {
+            uint8_t lreg = (instruction & 0x0F00) >> 8;
+            uint8_t rreg = (instruction & 0x00F0) >> 4;
+            switch (instruction & 0x000F) {
+                case 0x0000: {
+                    machine->registers[lreg] = machine->registers[rreg];
+                    machine->pc += 2;
+                    DPRINT("LD V%d, V%d\n", lreg, rreg);
+                    break;
+                }
+                case 0x0001: {
+                    machine->registers[lreg] |= machine->registers[rreg];
+                    if (machine->quirks & QUIRK_VF_RESET) {
+                        machine->registers[VF] = 0;
+                    }
+                    machine->pc += 2;
+                    DPRINT("OR V%d, V%d\n", lreg, rreg);
+                    break;
+                }
+                case 0x0002: {
+                    machine->registers[lreg] &= machine->registers[rreg];
+                    if (machine->quirks & QUIRK_VF_RESET) {
+                        machine->registers[VF] = 0;
+                    }
+                    machine->pc += 2;
+                    DPRINT("AND V%d, V%d\n", lreg, rreg);
+                    break;
+                }
+                case 0x0003: {
+                    machine->registers[lreg] ^= machine->registers[rreg];
+                    if (machine->quirks & QUIRK_VF_RESET) {
+                        machine->registers[VF] = 0;
+                    }
+                    machine->pc += 2;
+                    DPRINT("XOR V%d, V%d\n", lreg, rreg);
+                    break;
+                }
+                case 0x0004: {
+                    machine->registers[VF] = 255 - machine->registers[lreg] < machine->registers[rreg] ? 1 : 0;
+                    machine->registers[lreg] += machine->registers[rreg];
+                    machine->pc += 2;
+                    DPRINT("ADD V%d, V%d\n", lreg, rreg);
+                    break;
+                }
+                case 0x0005: {
+                    machine->registers[VF] = machine->registers[lreg] > machine->registers[rreg] ? 1 : 0;
+                    machine->registers[lreg] -= machine->registers[rreg];
+                    machine->pc += 2;
+                    DPRINT("SUB V%d, V%d\n", lreg, rreg);
+                    break;
+                }
+                case 0x0006: {
+                    uint8_t val = machine->registers[machine->quirks & QUIRK_SHIFT_IN_PLACE ? lreg : rreg];
+                    machine->registers[VF] = val & 0x01;
+                    machine->registers[lreg] = val >> 1;
+                    machine->pc += 2;
+                    DPRINT("SHR V%d {, V%d}\n", lreg, rreg);
+                    break;
+                }
+                case 0x0007: {
+                    machine->registers[VF] = machine->registers[rreg] > machine->registers[lreg] ? 1 : 0;
+                    machine->registers[lreg] = machine->registers[rreg] - machine->registers[lreg];
+                    machine->pc += 2;
+                    DPRINT("SUBN V%d, V%d\n", lreg, rreg);
+                    break;
+                }
+                case 0x000E: {
+                    uint8_t val = machine->registers[machine->quirks & QUIRK_SHIFT_IN_PLACE ? lreg : rreg];
+                    machine->registers[VF] = (val & 0x80) >> 7;
+                    machine->registers[lreg] = val << 1;
+                    machine->pc += 2;
+                    DPRINT("SHL V%d {, V%d}\n", lreg, rreg);
+                    break;
+                }
+                default: {
+                    return RaiseFault(machine, FAULT_ILLEGAL_OPCODE);
+                }
+            }
+            break;
+        }
+        case 0x9000: {
+            uint8_t lreg = (instruction & 0x0F00) >> 8;
+            uint8_t rreg = (instruction & 0x00F0) >> 4;
+            machine->pc += machine->registers[lreg] != machine->registers[rreg] ? 4 : 2;
+            DPRINT("SNE V%d, V%d\n", lreg, rreg);
+            break;
+        }
+        case 0xA000: {
+            uint16_t addr = instruction & 0x0FFF;
+            machine->reg_i = addr;
+            machine->pc += 2;
+            DPRINT("LD I, %d\n", addr);
+            break;
+        }
+        case 0xB000: {
+            uint16_t addr = instruction & 0x0FFF;
+            uint8_t reg = machine->quirks & QUIRK_JUMP_VX ? (instruction & 0x0F00) >> 8 : 0;
+            machine->pc = (addr + machine->registers[reg]) & ADDR_MASK;
+            DPRINT("JP V0, %d\n", addr);
+            break;
+        }
+        case 0xC000: {
+            uint8_t reg = (instruction & 0x0F00) >> 8;
+            uint8_t val = instruction & 0x00FF;
+            machine->registers[reg] = NextRandom(machine) & val;
+            machine->pc += 2;
+            DPRINT("RND V%d, %d\n", reg, val);
+            break;
+        }
+        case 0xD000: {
+            uint8_t lreg = (instruction & 0x0F00) >> 8;
+            uint8_t rreg = (instruction & 0x00F0) >> 4;
+            uint8_t nbytes = instruction & 0x000F;
+            if (machine->reg_i + nbytes > NUM_RAM) {
+                return RaiseFault(machine, FAULT_MEMORY_OUT_OF_RANGE);
+            }
+            machine->registers[VF] = 0;
+            // Each sprite byte straddles at most two display bytes; shift it into place and
+            // XOR both halves, wrapping around the right edge.
+            uint8_t x = machine->registers[lreg] % RESOLUTION_WIDTH;
+            uint8_t shift = x % 8;
+            uint8_t lcol = x / 8;
+            uint8_t rcol = (lcol + 1) % DISPLAY_ROW_BYTES;
+            uint8_t top = machine->registers[rreg] % RESOLUTION_HEIGHT;
+            uint8_t rmask = 0xFF;
+            if (machine->quirks & QUIRK_CLIP_SPRITES) {
+                // Drop the rows below the bottom edge and the bits past the right one.
+                nbytes = top + nbytes > RESOLUTION_HEIGHT ? RESOLUTION_HEIGHT - top : nbytes;
+                rmask = rcol == 0 ? 0 : 0xFF;
+            }
+            for (size_t i = machine->reg_i, y = top; i < machine->reg_i + nbytes; ++i, y = (y + 1) % RESOLUTION_HEIGHT) {
+                uint8_t sprite_byte = machine->ram[i];
+                uint8_t lbits = sprite_byte >> shift;
+                uint8_t rbits = shift == 0 ? 0 : (uint8_t)(sprite_byte << (8 - shift)) & rmask;
+                if ((machine->logical_pixels[y][lcol] & lbits) || (machine->logical_pixels[y][rcol] & rbits)) {
+                    machine->registers[VF] = 1;
+                }
+                machine->logical_pixels[y][lcol] ^= lbits;
+                machine->logical_pixels[y][rcol] ^= rbits;
+            }
+            if (machine->event_ring != NULL) {
+                EmitEvent(machine->event_ring, (Event){.type = EVENT_DRAW, .value = machine->registers[VF], .addr = machine->reg_i,
+                                                       .x = x, .y = top, .height = instruction & 0x000F});
+            }
+            machine->events |= RUN_DRAW;
+            machine->pc += 2;
+            DPRINT("DRW V%d, V%d, %d\n", lreg, rreg, nbytes);
+            break;
+        }
+        case 0xE000: {
+            uint8_t reg = (instruction & 0x0F00) >> 8;
+            switch (instruction & 0x00FF) {
+                case 0x009E: {
+                    machine->pc += machine->keys[machine->registers[reg] & 0x0F] ? 4 : 2;
+                    DPRINT("SKP V%d\n", reg);
+                    break;
+                }
+                case 0x00A1: {
+                    machine->pc += !machine->keys[machine->registers[reg] & 0x0F] ? 4 : 2;
+                    DPRINT("SKNP V%d\n", reg);
+                    break;
+                }
+                default: {
+                    return RaiseFault(machine, FAULT_ILLEGAL_OPCODE);
+                }
+            }
+            break;
+        }
+        case 0xF000: {
+            uint8_t reg = (instruction & 0x0F00) >> 8;
+            switch (instruction & 0x00FF) {
+                case 0x0007: {
+                    machine->registers[reg] = machine->delay_reg;
+                    machine->pc += 2;
+                    DPRINT("LD V%d, DT\n", reg);
+                    break;
+                }
+                case 0x000A: {
+                    // Wait for a key by re-executing this instruction until one is held, so
+                    // the interpreter itself never blocks on the host.
+                    machine->waiting_for_key = true;
+                    machine->events |= RUN_KEY_WAIT;
+                    for (uint8_t key = KEY_0; key <= KEY_F; ++key) {
+                        if (machine->keys[key]) {
+                            machine->registers[reg] = key;
+                            machine->pc += 2;
+                            machine->waiting_for_key = false;
+                            machine->events &= ~RUN_KEY_WAIT;
+                            break;
+                        }
+                    }
+                    DPRINT("LD V%d, K\n", reg);
+                    break;
+                }
+                case 0x0015: {
+                    machine->delay_reg = machine->registers[reg];
+                    machine->pc += 2;
+                    DPRINT("LD DT, V%d\n", reg);
+                    break;
+                }
+                case 0x0018: {
+                    if (machine->sound_reg == 0 && machine->registers[reg] > 0) {
+                        machine->events |= RUN_SOUND;
+                    }
+                    machine->sound_reg = machine->registers[reg];
+                    machine->pc += 2;
+                    DPRINT("LD ST, V%d\n", reg);
+                    break;
+                }
+                case 0x001E: {
+                    machine->reg_i += machine->registers[reg];
+                    machine->pc += 2;
+                    DPRINT("ADD I, V%d\n", reg);
+                    break;
+                }
+                case 0x0029: {
+                    // Only the low nibble names a hex digit.
+                    uint8_t font_idx = machine->registers[reg] & 0x0F;
+                    machine->reg_i = font_idx * FONT_SIZE;
+                    machine->pc += 2;
+                    DPRINT("LD F, V%d\n", reg);
+                    break;
+                }
+                case 0x0033: {
+                    if (machine->reg_i + 3 > NUM_RAM) {
+                        return RaiseFault(machine, FAULT_MEMORY_OUT_OF_RANGE);
+                    }
+                    uint8_t val = machine->registers[reg];
+                    machine->ram[machine->reg_i + 2] = val % 10;
+                    val /= 10;
+                    machine->ram[machine->reg_i + 1] = val % 10;
+                    val /= 10;
+                    machine->ram[machine->reg_i] = val;
+                    machine->pc += 2;
+                    DPRINT("LD B, V%d\n", reg);
+                    break;
+                }
+                case 0x0055: {
+                    if (machine->reg_i + reg + 1 > NUM_RAM) {
+                        return RaiseFault(machine, FAULT_MEMORY_OUT_OF_RANGE);
+                    }
+                    uint16_t addr = machine->reg_i;
+                    // TODO: implement as memcpy.
+                    for (uint8_t i = 0; i <= reg; ++i, ++addr) {
+                        machine->ram[addr] = machine->registers[i];
+                    }
+                    if (machine->quirks & QUIRK_LOAD_STORE_INC_I) {
+                        machine->reg_i = addr;
+                    }
+                    machine->pc += 2;
+                    DPRINT("LD [I], V%d\n", reg);
+                    break;
+                }
+                case 0x0065: {
+                    if (machine->reg_i + reg + 1 > NUM_RAM) {
+                        return RaiseFault(machine, FAULT_MEMORY_OUT_OF_RANGE);
+                    }
+                    uint16_t addr = machine->reg_i;
+                    for (uint8_t i = 0; i <= reg; ++i, ++addr) {
+                        machine->registers[i] = machine->ram[addr];
+                    }
+                    if (machine->quirks & QUIRK_LOAD_STORE_INC_I) {
+                        machine->reg_i = addr;
+                    }
+                    machine->pc += 2;
+                    DPRINT("LD V%d, [I]\n", reg);
+                    break;
+                }
+                default: {
+                    return RaiseFault(machine, FAULT_ILLEGAL_OPCODE);
+                }
+            }
+            break;
+        }
+        default: {
+            return RaiseFault(machine, FAULT_ILLEGAL_OPCODE);
+        }
+    }
+    // Skips, returns and fall-through run past 0xFFF; wrap them here so pc, and every stack
+    // entry pushed from it, is always a valid address.
+    machine->pc &= ADDR_MASK;
+    ++machine->cycles;
+    return FAULT_NONE;
+}
+
+Fault EmulateCycle(Chip8* machine) {
+    return ExecuteInstruction(machine);
+}
+
+RunExit RunCycles(Chip8* machine, uint32_t budget, uint8_t stop_on) {
+    machine->events = 0;
+    for (uint32_t i = 0; i < budget; ++i) {
+        if (ExecuteInstruction(machine) != FAULT_NONE) {
+            return RUN_FAULT;
+        }
+        // An instruction raises at most one event, and we stop on the first one asked for.
+        if (machine->events & stop_on) {
+            return (RunExit)(machine->events & stop_on);
+        }
+    }
+    return RUN_BUDGET;
+}
+
+static uint16_t FetchInstruction(const Chip8* machine, uint16_t addr) {
+    return machine->ram[(addr + 1) & ADDR_MASK] << 0 | machine->ram[addr & ADDR_MASK] << 8;
+}
+
+// Returns how many instructions one pass of the loop starting at pc takes if it is a busy-wait
+// that will keep spinning for the rest of the frame, or 0 if it is not. Keys and timers only
+// change between frames, so these loops cannot exit before the frame ends:
+//   JP pc                             (halt)
+//   SKP/SKNP Vx; JP pc                (wait for a key to change)
+//   LD Vx, DT; SE/SNE Vx, kk; JP pc   (wait for the delay timer)
+// FX0A without a key held is a one-instruction loop too.
+static uint32_t IdleLoopPeriod(const Chip8* machine) {
+    uint16_t pc = machine->pc & ADDR_MASK;
+    uint16_t first = FetchInstruction(machine, pc);
+    uint16_t second = FetchInstruction(machine, pc + 2);
+    uint16_t third = FetchInstruction(machine, pc + 4);
+    uint16_t jump_back = 0x1000 | pc;
+    uint8_t x = (first & 0x0F00) >> 8;
+    if (first == jump_back) {
+        return 1;
+    }
+    if ((first & 0xF0FF) == 0xF00A) {
+        return machine->waiting_for_key ? 1 : 0;
+    }
+    if ((first & 0xF0FF) == 0xE09E && second == jump_back) {
+        return machine->keys[machine->registers[x] & 0x0F] ? 0 : 2;
+    }
+    if ((first & 0xF0FF) == 0xE0A1 && second == jump_back) {
+        return machine->keys[machine->registers[x] & 0x0F] ? 2 : 0;
+    }
+    if ((first & 0xF0FF) == 0xF007 && (second & 0x0F00) >> 8 == x && third == jump_back) {
+        uint8_t kk = second & 0x00FF;
+        if ((second & 0xF000) == 0x3000) {
+            return machine->delay_reg != kk ? 3 : 0;
+        }
+        if ((second & 0xF000) == 0x4000) {
+            return machine->delay_reg == kk ? 3 : 0;
+        }
+    }
+    return 0;
+}
+
+// Accounts for every whole pass of an idle loop left in the frame without running them. Each
+// pass ends back at pc with the same state, so only the cycle counters move; the leftover
+// partial pass is executed normally, keeping cycle accounting exact.
+static void SkipIdleLoop(Chip8* machine) {
+    uint32_t period = IdleLoopPeriod(machine);
+    if (period == 0) {
+        return ;
+    }
+    uint32_t passes = (machine->cycles_per_frame - machine->frame_cycle) / period;
+    if (passes == 0) {
+        return ;
+    }
+    if (period == 3) {
+        // As left by LD Vx, DT on every pass.
+        machine->registers[(FetchInstruction(machine, machine->pc) & 0x0F00) >> 8] = machine->delay_reg;
+    }
+    machine->cycles += passes * period;
+    machine->frame_cycle += passes * period;
+    machine->idle_cycles += passes * period;
+    return ;
+}
+
+RunExit RunFrame(Chip8* machine, uint8_t stop_on) {
+    uint8_t idle_events = machine->skip_idle_loops ? RUN_IDLE_LOOP | RUN_KEY_WAIT : 0;
+    for (;;) {
+        uint64_t start = machine->cycles;
+        RunExit exit = RunCycles(machine, machine->cycles_per_frame - machine->frame_cycle, stop_on | idle_events);
+        machine->frame_cycle += machine->cycles - start;
+        if (exit & stop_on) {
+            return exit;
+        }
+        if (exit & idle_events) {
+            SkipIdleLoop(machine);
+            continue;
+        }
+        if (exit != RUN_BUDGET) {
+            return exit;
+        }
+        machine->frame_cycle = 0;
+        TickTimers(machine);
+        return RUN_FRAME;
+    }
+}
+
+uint16_t GetKeyMask(const Chip8* machine) {
+    uint16_t mask = 0;
+    for (uint8_t key = KEY_0; key <= KEY_F; ++key) {
+        mask |= machine->keys[key] << key;
+    }
+    return mask;
+}
+
+void SetKeyMask(Chip8* machine, uint16_t mask) {
+    for (uint8_t key = KEY_0; key <= KEY_F; ++key) {
+        machine->keys[key] = (mask >> key) & 1;
+    }
+    return ;
+}
+
+// Called once per 60 Hz frame.
+void TickTimers(Chip8* machine) {
+    if (machine->delay_reg > 0) {
+        --machine->delay_reg;
+    }
+    if (machine->sound_reg > 0) {
+        --machine->sound_reg;
+    }
+    if (machine->event_ring != NULL) {
+        EmitRamChanges(machine->event_ring, machine->ram);
+        atomic_fetch_add_explicit(&machine->event_ring->frame, 1, memory_order_relaxed);
+    }
+    return ;
+}
+
+size_t EventRingSize(uint32_t capacity) {
+    return sizeof(EventRing) + (size_t)capacity * sizeof(Event);
+}
+
+void AttachEventRing(Chip8* machine, EventRing* ring, uint32_t capacity) {
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    memset(ring, 0, sizeof(EventRing));
+    ring->capacity = capacity;
+    memcpy(ring->ram, machine->ram, NUM_RAM);
+    // Written last, so a reader that sees the magic sees the rest.
+    atomic_thread_fence(memory_order_release);
+    ring->magic = EVENT_RING_MAGIC;
+    machine->event_ring = ring;
+    return ;
+}
+
+void RewindEventRing(Chip8* machine, uint32_t frame) {
+    EventRing* ring = machine->event_ring;
+    memcpy(ring->ram, machine->ram, NUM_RAM);
+    atomic_store_explicit(&ring->frame, frame, memory_order_relaxed);
+    EmitEvent(ring, (Event){.type = EVENT_REWIND});
+    return ;
+}
+
+size_t EventRingPeek(EventRing* ring, const Event** records) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t start = tail & (ring->capacity - 1);
+    uint64_t n = head - tail;
+    *records = &ring->records[start];
+    return n < ring->capacity - start ? n : ring->capacity - start;
+}
+
+void EventRingConsume(EventRing* ring, size_t n) {
+    atomic_fetch_add_explicit(&ring->tail, n, memory_order_release);
+    return ;
+}
+
+const char* FaultName(Fault fault) {
+    switch (fault) {
+        case FAULT_NONE: {
+            return "none";
+        }
+        case FAULT_STACK_OVERFLOW: {
+            return "stack overflow";
+        }
+        case FAULT_STACK_UNDERFLOW: {
+            return "stack underflow";
+        }
+        case FAULT_ILLEGAL_OPCODE: {
+            return "illegal opcode";
+        }
+        case FAULT_MEMORY_OUT_OF_RANGE: {
+            return "memory out of range";
+        }
+    }
+    return "unknown";
+}
+
+void PrintFault(FILE* file, const Chip8* machine) {
+    uint16_t pc = machine->pc & ADDR_MASK;
+    uint16_t instruction = machine->ram[(pc + 1) & ADDR_MASK] << 0 | machine->ram[pc] << 8;
+    fprintf(file, "%s at pc 0x%03" PRIx16 " (instruction 0x%04" PRIx16 ", I 0x%03" PRIx16 ", sp %d)\n",
+            FaultName(machine->fault), pc, instruction, machine->reg_i, machine->sp);
+    return ;
+}
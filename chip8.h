@@ -0,0 +1,249 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define RESOLUTION_WIDTH 64
+#define RESOLUTION_HEIGHT 32
+// The display is bit-packed, one bit per pixel, most significant bit leftmost. This is
+// byte-for-byte the layout of a PBM/PNG 1-bit scanline and of ffmpeg's monob format.
+#define DISPLAY_ROW_BYTES (RESOLUTION_WIDTH / 8)
+#define DISPLAY_BYTES (RESOLUTION_HEIGHT * DISPLAY_ROW_BYTES)
+
+#ifndef DEBUG
+    #define DEBUG 0
+#endif
+
+// Debug printing macro function.
+// https://stackoverflow.com/questions/1644868/define-macro-for-debug-printing-in-c
+#define DPRINT(...) \
+    do { if (DEBUG) printf(__VA_ARGS__); } while (0)
+
+#define NUM_RAM 4096
+// Addresses are 12 bits; fetches and jumps wrap instead of leaving ram.
+#define ADDR_MASK (NUM_RAM - 1)
+#define PROGRAM_START 0x200
+#define NUM_REG 16
+#define NUM_STACK 16
+#define VF 15
+#define NUM_FONTS 16
+#define FONT_SIZE 5
+#define MAX_SPRITE_SIZE_BYTES 15
+
+// The delay and sound timers count down at 60 Hz. 14 instructions per frame is the ~840 Hz
+// the original 1200us per-instruction sleep gave.
+#define FRAME_RATE 60
+#define CYCLES_PER_FRAME 14
+
+typedef enum {
+    KEY_0,
+    KEY_1,
+    KEY_2,
+    KEY_3,
+    KEY_4,
+    KEY_5,
+    KEY_6,
+    KEY_7,
+    KEY_8,
+    KEY_9,
+    KEY_A,
+    KEY_B,
+    KEY_C,
+    KEY_D,
+    KEY_E,
+    KEY_F,
+    KEY_UNKNOWN
+} Key;
+
+#define NUM_KEYS 17
+
+// Behaviours that differ between CHIP-8 interpreters. Games are written against one of them,
+// so the machine runs with whichever set the game expects.
+typedef enum {
+    // 8XY6/8XYE shift VX in place instead of loading it from VY shifted.
+    QUIRK_SHIFT_IN_PLACE = 1 << 0,
+    // FX55/FX65 leave I pointing past the last register stored or loaded.
+    QUIRK_LOAD_STORE_INC_I = 1 << 1,
+    // BNNN jumps to XNN + VX instead of NNN + V0.
+    QUIRK_JUMP_VX = 1 << 2,
+    // 8XY1/8XY2/8XY3 clear VF.
+    QUIRK_VF_RESET = 1 << 3,
+    // Sprites are cut off at the screen edges instead of wrapping around.
+    QUIRK_CLIP_SPRITES = 1 << 4,
+} Quirk;
+
+// How this interpreter has always behaved.
+#define QUIRKS_DEFAULT QUIRK_SHIFT_IN_PLACE
+// The COSMAC VIP interpreter.
+#define QUIRKS_VIP (QUIRK_LOAD_STORE_INC_I | QUIRK_VF_RESET | QUIRK_CLIP_SPRITES)
+// SUPER-CHIP 1.1.
+#define QUIRKS_SCHIP (QUIRK_SHIFT_IN_PLACE | QUIRK_JUMP_VX | QUIRK_CLIP_SPRITES)
+
+// Why a machine stopped. A faulting instruction has no side effects and leaves pc on itself,
+// so the state can be inspected as it was, and stepping again reports the same fault.
+typedef enum {
+    FAULT_NONE,
+    FAULT_STACK_OVERFLOW,
+    FAULT_STACK_UNDERFLOW,
+    FAULT_ILLEGAL_OPCODE,
+    // An access through I would run past the end of ram.
+    FAULT_MEMORY_OUT_OF_RANGE,
+} Fault;
+
+// Why RunCycles or RunFrame returned. The first three are also the bits of their stop_on mask.
+typedef enum {
+    // Executed 00E0 or DXYN.
+    RUN_DRAW = 1 << 0,
+    // FX0A found no key held and will run again.
+    RUN_KEY_WAIT = 1 << 1,
+    // FX18 started the sound timer from zero.
+    RUN_SOUND = 1 << 2,
+    RUN_FAULT = 1 << 3,
+    // Executed the whole budget.
+    RUN_BUDGET = 1 << 4,
+    // Finished a frame and ticked the timers.
+    RUN_FRAME = 1 << 5,
+    // A short backward jump that may close a busy-wait loop. RunFrame uses it internally to
+    // fast-forward idle loops; it is never returned from RunFrame.
+    RUN_IDLE_LOOP = 1 << 6,
+} RunExit;
+
+// Observation stream. A machine with an EventRing attached appends a record for every sprite
+// drawn and, when each frame ends, one for every ram byte that changed during it. The ring
+// is plain memory with no pointers, so it can live in shared memory and be read in place by
+// another process while the machine runs. One producer and one consumer: the machine only
+// advances head, the reader only advances tail, and records that find the ring full are
+// dropped and counted rather than stalling the machine.
+typedef enum {
+    // DXYN: x, y and height of the sprite, addr its address in ram, value 1 if it collided.
+    EVENT_DRAW = 1,
+    // A ram byte that differs from the end of the previous frame: addr and its new value.
+    EVENT_RAM = 2,
+    // The machine went back to the start of frame, e.g. for a netplay rollback. Records
+    // already read for frame and later are superseded by the ones that follow.
+    EVENT_REWIND = 3,
+} EventType;
+
+typedef struct {
+    // Frames ended since the ring was attached.
+    uint32_t frame;
+    uint8_t type;
+    uint8_t value;
+    uint16_t addr;
+    uint8_t x;
+    uint8_t y;
+    uint8_t height;
+    uint8_t reserved;
+} Event;
+
+#define EVENT_RING_MAGIC 0x43384556
+
+typedef struct {
+    uint32_t magic;
+    // A power of two.
+    uint32_t capacity;
+    // Records ever written and ever consumed; the live ones are [tail, head), at index % capacity.
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    _Atomic uint32_t frame;
+    // Ram as of the end of the last frame, which the next frame's changes are found against.
+    uint8_t ram[NUM_RAM];
+    Event records[];
+} EventRing;
+
+typedef struct {
+    uint8_t ram[NUM_RAM];
+    uint16_t stack[NUM_STACK];
+
+    uint8_t registers[NUM_REG];
+    uint16_t reg_i;
+    uint8_t delay_reg;
+    uint8_t sound_reg;
+
+    uint16_t pc;
+    uint8_t sp;
+
+    uint8_t logical_pixels[RESOLUTION_HEIGHT][DISPLAY_ROW_BYTES];
+    bool keys[NUM_KEYS];
+    // Set while FX0A is holding the machine until a key is pressed.
+    bool waiting_for_key;
+    Fault fault;
+    // Quirk bits.
+    uint8_t quirks;
+    // CXKK's random number generator, so a run is reproducible from its seed.
+    uint32_t rng;
+
+    // Instructions executed since InitCHIP8.
+    uint64_t cycles;
+    uint32_t cycles_per_frame;
+    // Instructions already run in the current frame, when a RunFrame returned early.
+    uint32_t frame_cycle;
+    // RunExit bits raised since RunCycles started.
+    uint8_t events;
+    // Whether RunFrame fast-forwards busy-wait loops, and how many instructions it skipped.
+    // Skipping leaves the machine exactly where running the loop would have.
+    bool skip_idle_loops;
+    uint64_t idle_cycles;
+
+    // Where draw and ram events go, or NULL. Not part of the machine's state: whoever copies a
+    // machine over another keeps the destination's ring.
+    EventRing* event_ring;
+} Chip8;
+
+void InitCHIP8(Chip8* machine);
+
+// Restarts CXKK's random sequence. Any seed, including 0, is valid.
+void SeedRandom(Chip8* machine, uint32_t seed);
+
+// Copies a program into ram at PROGRAM_START. Returns false if it does not fit.
+bool LoadProgram(Chip8* machine, const uint8_t* data, size_t size);
+
+// Executes one instruction.
+Fault EmulateCycle(Chip8* machine);
+
+// Executes up to budget instructions in one tight loop. Stops early after an instruction that
+// raises one of the events in stop_on (RUN_DRAW | RUN_KEY_WAIT | RUN_SOUND), or on a fault.
+// machine->cycles tells how many instructions actually ran.
+RunExit RunCycles(Chip8* machine, uint32_t budget, uint8_t stop_on);
+
+// Runs the rest of the current frame, then ticks the timers and returns RUN_FRAME. If it stops
+// early on an event, calling it again picks up where the frame left off. Loops that can only
+// spin until the frame ends (waiting on a key or the delay timer) are skipped analytically.
+RunExit RunFrame(Chip8* machine, uint8_t stop_on);
+
+// The held keys as a bitmask, bit n for key n; the form recordings and netplay exchange.
+uint16_t GetKeyMask(const Chip8* machine);
+void SetKeyMask(Chip8* machine, uint16_t mask);
+
+// Counts the delay and sound timers down; called at 60 Hz. This ends the frame for the
+// machine's event ring, if it has one.
+void TickTimers(Chip8* machine);
+
+// Bytes an EventRing of capacity records takes. capacity must be a power of two.
+size_t EventRingSize(uint32_t capacity);
+
+// Initialises ring in memory of EventRingSize(capacity) bytes and attaches it to the machine.
+void AttachEventRing(Chip8* machine, EventRing* ring, uint32_t capacity);
+
+// Rewinds the machine's ring to the start of frame, after the machine has been restored to
+// the state it had then. Later ram changes are found against the restored ram, frames are
+// numbered from frame again, and an EVENT_REWIND tells the reader.
+void RewindEventRing(Chip8* machine, uint32_t frame);
+
+// The reader's side. Points records at the oldest waiting record and returns how many can be
+// read in place from there (the rest, if any, wrap to the start of the ring). Read them, then
+// release them with EventRingConsume(ring, n).
+size_t EventRingPeek(EventRing* ring, const Event** records);
+void EventRingConsume(EventRing* ring, size_t n);
+
+const char* FaultName(Fault fault);
+
+// Prints a one-line description of the machine's fault, e.g. for a batch runner's log.
+void PrintFault(FILE* file, const Chip8* machine);
+
+#endif
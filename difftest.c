@@ -0,0 +1,702 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "chip8.h"
+
+// Differential tester. Runs the core in chip8.c in lockstep with the reference stepper below,
+// a plain interpreter with an unpacked display and no fast paths, and compares the machines
+// after every instruction. The reference spells out the semantics the core has to keep, so
+// any speedup of the core that changes behaviour shows up here.
+//
+// Each program runs twice: once an instruction at a time through RunCycles, and once a frame
+// at a time through RunFrame, whose idle-loop skipping is then checked at frame boundaries.
+
+#define DEFAULT_FRAMES 600
+#define DEFAULT_PROGRAMS 10000
+#define RANDOM_PROGRAM_WORDS 256
+#define TRACE_LENGTH 16
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+} Rom;
+
+void RomInit(Rom* rom, const char* filename) {
+    assert(rom != NULL);
+    int rom_fd = open(filename, O_RDONLY);
+    if (rom_fd == -1) {
+        char* err_msg = (char*)calloc(strlen("open ") + strlen(filename) + 1, sizeof(char));
+        strcat(err_msg, "open ");
+        strcat(err_msg, filename);
+        perror(err_msg);
+        exit(EXIT_FAILURE);
+    }
+
+    off_t nseek = lseek(rom_fd, 0L, SEEK_END);
+    if (nseek == -1) {
+        perror("lseek end");
+        exit(EXIT_FAILURE);
+    }
+
+    if (lseek(rom_fd, 0L, SEEK_SET) == -1) {
+        perror("lseek start");
+        exit(EXIT_FAILURE);
+    }
+
+    rom->data = calloc(nseek, sizeof(uint8_t));
+    rom->size = nseek;
+    ssize_t nread = read(rom_fd, rom->data, nseek);
+    if (nread == -1) {
+        perror("read rom");
+        exit(EXIT_FAILURE);
+    }
+
+    if (close(rom_fd) == -1) {
+        perror("close rom");
+        exit(EXIT_FAILURE);
+    }
+
+    return ;
+}
+
+typedef struct {
+    uint8_t ram[NUM_RAM];
+    uint8_t v[NUM_REG];
+    uint16_t i;
+    uint16_t pc;
+    uint16_t stack[NUM_STACK];
+    uint8_t sp;
+    uint8_t dt;
+    uint8_t st;
+    bool display[RESOLUTION_HEIGHT][RESOLUTION_WIDTH];
+    bool keys[16];
+    uint8_t quirks;
+    uint32_t rng;
+    Fault fault;
+    // Instructions completed, which the core's cycle counter must match even when it skips
+    // idle loops instead of running them.
+    uint64_t cycles;
+} Reference;
+
+// The reference starts from the core's freshly loaded machine, so both share fonts, program,
+// quirks and random state.
+void RefInit(Reference* ref, const Chip8* machine) {
+    memset(ref, 0, sizeof(Reference));
+    memcpy(ref->ram, machine->ram, NUM_RAM);
+    memcpy(ref->v, machine->registers, NUM_REG);
+    ref->i = machine->reg_i;
+    ref->pc = machine->pc;
+    ref->quirks = machine->quirks;
+    ref->rng = machine->rng;
+    ref->cycles = machine->cycles;
+    return ;
+}
+
+uint8_t RefRandom(Reference* ref) {
+    ref->rng ^= ref->rng << 13;
+    ref->rng ^= ref->rng >> 17;
+    ref->rng ^= ref->rng << 5;
+    return ref->rng >> 24;
+}
+
+// Executes one instruction. A faulting instruction changes nothing. Flags are written before
+// results, so VF as an operand or destination sees the flag, as in the core.
+void RefStep(Reference* ref) {
+    uint16_t op = ref->ram[ref->pc % NUM_RAM] << 8 | ref->ram[(ref->pc + 1) % NUM_RAM];
+    uint8_t x = op >> 8 & 0xF;
+    uint8_t y = op >> 4 & 0xF;
+    uint8_t n = op & 0xF;
+    uint8_t kk = op & 0xFF;
+    uint16_t nnn = op & 0xFFF;
+    uint16_t next = ref->pc + 2;
+    switch (op >> 12) {
+        case 0x0: {
+            if (op == 0x00E0) {
+                memset(ref->display, 0, sizeof(ref->display));
+            } else if (op == 0x00EE) {
+                if (ref->sp == 0) {
+                    ref->fault = FAULT_STACK_UNDERFLOW;
+                    return ;
+                }
+                ref->sp -= 1;
+                next = ref->stack[ref->sp] + 2;
+            } else {
+                ref->fault = FAULT_ILLEGAL_OPCODE;
+                return ;
+            }
+            break;
+        }
+        case 0x1: {
+            next = nnn;
+            break;
+        }
+        case 0x2: {
+            if (ref->sp == NUM_STACK) {
+                ref->fault = FAULT_STACK_OVERFLOW;
+                return ;
+            }
+            ref->stack[ref->sp] = ref->pc;
+            ref->sp += 1;
+            next = nnn;
+            break;
+        }
+        case 0x3: {
+            if (ref->v[x] == kk) {
+                next += 2;
+            }
+            break;
+        }
+        case 0x4: {
+            if (ref->v[x] != kk) {
+                next += 2;
+            }
+            break;
+        }
+        case 0x5: {
+            if (ref->v[x] == ref->v[y]) {
+                next += 2;
+            }
+            break;
+        }
+        case 0x6: {
+            ref->v[x] = kk;
+            break;
+        }
+        case 0x7: {
+            ref->v[x] = ref->v[x] + kk;
+            break;
+        }
+        case 0x8: {
+            bool vf_reset = ref->quirks & QUIRK_VF_RESET;
+            uint8_t shift_src = ref->quirks & QUIRK_SHIFT_IN_PLACE ? x : y;
+            switch (n) {
+                case 0x0: {
+                    ref->v[x] = ref->v[y];
+                    break;
+                }
+                case 0x1: {
+                    ref->v[x] = ref->v[x] | ref->v[y];
+                    if (vf_reset) {
+                        ref->v[VF] = 0;
+                    }
+                    break;
+                }
+                case 0x2: {
+                    ref->v[x] = ref->v[x] & ref->v[y];
+                    if (vf_reset) {
+                        ref->v[VF] = 0;
+                    }
+                    break;
+                }
+                case 0x3: {
+                    ref->v[x] = ref->v[x] ^ ref->v[y];
+                    if (vf_reset) {
+                        ref->v[VF] = 0;
+                    }
+                    break;
+                }
+                case 0x4: {
+                    ref->v[VF] = ref->v[x] + ref->v[y] > 255;
+                    ref->v[x] = ref->v[x] + ref->v[y];
+                    break;
+                }
+                case 0x5: {
+                    ref->v[VF] = ref->v[x] > ref->v[y];
+                    ref->v[x] = ref->v[x] - ref->v[y];
+                    break;
+                }
+                case 0x6: {
+                    uint8_t val = ref->v[shift_src];
+                    ref->v[VF] = val & 1;
+                    ref->v[x] = val >> 1;
+                    break;
+                }
+                case 0x7: {
+                    ref->v[VF] = ref->v[y] > ref->v[x];
+                    ref->v[x] = ref->v[y] - ref->v[x];
+                    break;
+                }
+                case 0xE: {
+                    uint8_t val = ref->v[shift_src];
+                    ref->v[VF] = val >> 7;
+                    ref->v[x] = val << 1;
+                    break;
+                }
+                default: {
+                    ref->fault = FAULT_ILLEGAL_OPCODE;
+                    return ;
+                }
+            }
+            break;
+        }
+        case 0x9: {
+            if (ref->v[x] != ref->v[y]) {
+                next += 2;
+            }
+            break;
+        }
+        case 0xA: {
+            ref->i = nnn;
+            break;
+        }
+        case 0xB: {
+            next = (nnn + ref->v[ref->quirks & QUIRK_JUMP_VX ? x : 0]) % NUM_RAM;
+            break;
+        }
+        case 0xC: {
+            ref->v[x] = RefRandom(ref) & kk;
+            break;
+        }
+        case 0xD: {
+            if (ref->i + n > NUM_RAM) {
+                ref->fault = FAULT_MEMORY_OUT_OF_RANGE;
+                return ;
+            }
+            bool clip = ref->quirks & QUIRK_CLIP_SPRITES;
+            ref->v[VF] = 0;
+            uint8_t left = ref->v[x] % RESOLUTION_WIDTH;
+            uint8_t top = ref->v[y] % RESOLUTION_HEIGHT;
+            for (uint8_t row = 0; row < n; ++row) {
+                if (clip && top + row >= RESOLUTION_HEIGHT) {
+                    break;
+                }
+                for (uint8_t col = 0; col < 8; ++col) {
+                    if (clip && left + col >= RESOLUTION_WIDTH) {
+                        break;
+                    }
+                    if ((ref->ram[ref->i + row] >> (7 - col) & 1) == 0) {
+                        continue;
+                    }
+                    bool* pixel = &ref->display[(top + row) % RESOLUTION_HEIGHT][(left + col) % RESOLUTION_WIDTH];
+                    if (*pixel) {
+                        ref->v[VF] = 1;
+                    }
+                    *pixel = !*pixel;
+                }
+            }
+            break;
+        }
+        case 0xE: {
+            if (kk == 0x9E) {
+                if (ref->keys[ref->v[x] & 0xF]) {
+                    next += 2;
+                }
+            } else if (kk == 0xA1) {
+                if (!ref->keys[ref->v[x] & 0xF]) {
+                    next += 2;
+                }
+            } else {
+                ref->fault = FAULT_ILLEGAL_OPCODE;
+                return ;
+            }
+            break;
+        }
+        case 0xF: {
+            switch (kk) {
+                case 0x07: {
+                    ref->v[x] = ref->dt;
+                    break;
+                }
+                case 0x0A: {
+                    // Stays on this instruction until a key is held; the lowest one wins.
+                    next = ref->pc;
+                    for (uint8_t key = 0; key < 16; ++key) {
+                        if (ref->keys[key]) {
+                            ref->v[x] = key;
+                            next = ref->pc + 2;
+                            break;
+                        }
+                    }
+                    break;
+                }
+                case 0x15: {
+                    ref->dt = ref->v[x];
+                    break;
+                }
+                case 0x18: {
+                    ref->st = ref->v[x];
+                    break;
+                }
+                case 0x1E: {
+                    ref->i = ref->i + ref->v[x];
+                    break;
+                }
+                case 0x29: {
+                    ref->i = (ref->v[x] & 0xF) * FONT_SIZE;
+                    break;
+                }
+                case 0x33: {
+                    if (ref->i + 3 > NUM_RAM) {
+                        ref->fault = FAULT_MEMORY_OUT_OF_RANGE;
+                        return ;
+                    }
+                    ref->ram[ref->i] = ref->v[x] / 100;
+                    ref->ram[ref->i + 1] = ref->v[x] / 10 % 10;
+                    ref->ram[ref->i + 2] = ref->v[x] % 10;
+                    break;
+                }
+                case 0x55:
+                case 0x65: {
+                    if (ref->i + x + 1 > NUM_RAM) {
+                        ref->fault = FAULT_MEMORY_OUT_OF_RANGE;
+                        return ;
+                    }
+                    for (uint8_t reg = 0; reg <= x; ++reg) {
+                        if (kk == 0x55) {
+                            ref->ram[ref->i + reg] = ref->v[reg];
+                        } else {
+                            ref->v[reg] = ref->ram[ref->i + reg];
+                        }
+                    }
+                    if (ref->quirks & QUIRK_LOAD_STORE_INC_I) {
+                        ref->i = ref->i + x + 1;
+                    }
+                    break;
+                }
+                default: {
+                    ref->fault = FAULT_ILLEGAL_OPCODE;
+                    return ;
+                }
+            }
+            break;
+        }
+    }
+    ref->pc = next % NUM_RAM;
+    ++ref->cycles;
+    return ;
+}
+
+void RefTickTimers(Reference* ref) {
+    if (ref->dt > 0) {
+        ref->dt -= 1;
+    }
+    if (ref->st > 0) {
+        ref->st -= 1;
+    }
+    return ;
+}
+
+void RefPackDisplay(const Reference* ref, uint8_t packed[DISPLAY_BYTES]) {
+    memset(packed, 0, DISPLAY_BYTES);
+    for (size_t y = 0; y < RESOLUTION_HEIGHT; ++y) {
+        for (size_t x = 0; x < RESOLUTION_WIDTH; ++x) {
+            packed[y * DISPLAY_ROW_BYTES + x / 8] |= ref->display[y][x] << (7 - x % 8);
+        }
+    }
+    return ;
+}
+
+uint64_t Fnv1a(const uint8_t* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+typedef struct {
+    uint16_t pc;
+    uint16_t instruction;
+} TraceEntry;
+
+// The instructions leading up to the current one, oldest first when read from next.
+typedef struct {
+    TraceEntry entries[TRACE_LENGTH];
+    size_t next;
+    size_t count;
+} Trace;
+
+void TraceRecord(Trace* trace, const Reference* ref) {
+    trace->entries[trace->next] = (TraceEntry){ref->pc, ref->ram[ref->pc % NUM_RAM] << 8 | ref->ram[(ref->pc + 1) % NUM_RAM]};
+    trace->next = (trace->next + 1) % TRACE_LENGTH;
+    trace->count += trace->count < TRACE_LENGTH;
+    return ;
+}
+
+void PrintField(const char* name, unsigned core, unsigned ref) {
+    if (core != ref) {
+        printf("  %-8s core %-6x reference %x\n", name, core, ref);
+    }
+    return ;
+}
+
+// Prints the instructions that led here and the fields that differ.
+void DumpDivergence(const char* name, unsigned long frame, const Trace* trace, const Chip8* machine, const Reference* ref) {
+    printf("%s: divergence in frame %lu\n", name, frame);
+    printf("  last instructions, as run by the reference:\n");
+    for (size_t k = 0; k < trace->count; ++k) {
+        const TraceEntry* entry = &trace->entries[(trace->next + TRACE_LENGTH - trace->count + k) % TRACE_LENGTH];
+        printf("    %03" PRIx16 ": %04" PRIx16 "\n", entry->pc, entry->instruction);
+    }
+    printf("  differences after the last one:\n");
+    PrintField("fault", machine->fault, ref->fault);
+    PrintField("pc", machine->pc, ref->pc);
+    PrintField("I", machine->reg_i, ref->i);
+    PrintField("sp", machine->sp, ref->sp);
+    PrintField("DT", machine->delay_reg, ref->dt);
+    PrintField("ST", machine->sound_reg, ref->st);
+    if (machine->cycles != ref->cycles) {
+        printf("  %-8s core %-6" PRIu64 " reference %" PRIu64 "\n", "cycles", machine->cycles, ref->cycles);
+    }
+    for (uint8_t reg = 0; reg < NUM_REG; ++reg) {
+        char field[8];
+        snprintf(field, sizeof(field), "V%X", reg);
+        PrintField(field, machine->registers[reg], ref->v[reg]);
+    }
+    for (uint8_t level = 0; level < NUM_STACK; ++level) {
+        char field[16];
+        snprintf(field, sizeof(field), "stack[%d]", level);
+        PrintField(field, machine->stack[level], ref->stack[level]);
+    }
+    uint8_t packed[DISPLAY_BYTES];
+    RefPackDisplay(ref, packed);
+    for (size_t addr = 0; addr < NUM_RAM; ++addr) {
+        if (machine->ram[addr] != ref->ram[addr]) {
+            printf("  ram      core %016" PRIx64 " reference %016" PRIx64 " (hashes), first difference at 0x%03zx: core %02x reference %02x\n",
+                   Fnv1a(machine->ram, NUM_RAM), Fnv1a(ref->ram, NUM_RAM), addr, machine->ram[addr], ref->ram[addr]);
+            break;
+        }
+    }
+    if (memcmp(machine->logical_pixels, packed, DISPLAY_BYTES) != 0) {
+        printf("  display  core %016" PRIx64 " reference %016" PRIx64 " (hashes)\n",
+               Fnv1a((const uint8_t*)machine->logical_pixels, DISPLAY_BYTES), Fnv1a(packed, DISPLAY_BYTES));
+    }
+    fflush(stdout);
+    return ;
+}
+
+bool SameState(const Chip8* machine, const Reference* ref) {
+    if (machine->fault != ref->fault || machine->pc != ref->pc || machine->reg_i != ref->i || machine->sp != ref->sp
+        || machine->delay_reg != ref->dt || machine->sound_reg != ref->st || machine->cycles != ref->cycles
+        || memcmp(machine->registers, ref->v, NUM_REG) != 0
+        || memcmp(machine->stack, ref->stack, sizeof(machine->stack)) != 0
+        || memcmp(machine->ram, ref->ram, NUM_RAM) != 0) {
+        return false;
+    }
+    uint8_t packed[DISPLAY_BYTES];
+    RefPackDisplay(ref, packed);
+    return memcmp(machine->logical_pixels, packed, DISPLAY_BYTES) == 0;
+}
+
+uint32_t NextRandom32(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Which keys are held in each frame: the same for both machines, changing now and then.
+uint16_t NextKeys(uint32_t* state, uint16_t keys) {
+    if (NextRandom32(state) % 8 != 0) {
+        return keys;
+    }
+    uint32_t roll = NextRandom32(state) % 20;
+    return roll < 16 ? 1 << roll : 0;
+}
+
+void SetRefKeys(Reference* ref, uint16_t keys) {
+    for (uint8_t key = 0; key < 16; ++key) {
+        ref->keys[key] = keys >> key & 1;
+    }
+    return ;
+}
+
+// Runs both machines for the given number of frames. Returns false on the first divergence,
+// after dumping it. Instructions compared are added to compared.
+bool RunLockstep(const char* name, const Chip8* initial, unsigned long frames, uint32_t key_seed, uint64_t* compared) {
+    static Chip8 machine;
+    static Reference ref;
+    machine = *initial;
+    RefInit(&ref, initial);
+    Trace trace = {0};
+    uint32_t key_state = key_seed | 1;
+    uint16_t keys = 0;
+    for (unsigned long frame = 0; frame < frames; ++frame) {
+        keys = NextKeys(&key_state, keys);
+        SetKeyMask(&machine, keys);
+        SetRefKeys(&ref, keys);
+        for (uint32_t cycle = 0; cycle < machine.cycles_per_frame; ++cycle) {
+            TraceRecord(&trace, &ref);
+            RunCycles(&machine, 1, 0);
+            RefStep(&ref);
+            ++*compared;
+            if (!SameState(&machine, &ref)) {
+                DumpDivergence(name, frame, &trace, &machine, &ref);
+                return false;
+            }
+            if (ref.fault != FAULT_NONE) {
+                return true;
+            }
+        }
+        TickTimers(&machine);
+        RefTickTimers(&ref);
+    }
+
+    // Again a frame at a time, so idle loops are skipped rather than run.
+    machine = *initial;
+    RefInit(&ref, initial);
+    trace = (Trace){0};
+    key_state = key_seed | 1;
+    keys = 0;
+    for (unsigned long frame = 0; frame < frames; ++frame) {
+        keys = NextKeys(&key_state, keys);
+        SetKeyMask(&machine, keys);
+        SetRefKeys(&ref, keys);
+        RunFrame(&machine, 0);
+        uint64_t frame_start = ref.cycles;
+        for (uint32_t cycle = 0; cycle < machine.cycles_per_frame && ref.fault == FAULT_NONE; ++cycle) {
+            TraceRecord(&trace, &ref);
+            RefStep(&ref);
+        }
+        // A finished frame leaves nothing carried over; one cut short by a fault leaves what ran.
+        uint32_t frame_cycle = 0;
+        if (ref.fault == FAULT_NONE) {
+            RefTickTimers(&ref);
+        } else {
+            frame_cycle = ref.cycles - frame_start;
+        }
+        if (!SameState(&machine, &ref) || machine.frame_cycle != frame_cycle) {
+            DumpDivergence(name, frame, &trace, &machine, &ref);
+            PrintField("frame_cycle", machine.frame_cycle, frame_cycle);
+            return false;
+        }
+        if (ref.fault != FAULT_NONE) {
+            return true;
+        }
+    }
+    return true;
+}
+
+// A random but mostly well-formed instruction, with jumps kept inside the program so it runs
+// for a while before faulting.
+uint16_t RandomInstruction(uint32_t* state, size_t words) {
+    const uint8_t f_ops[] = {0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x33, 0x55, 0x65};
+    uint32_t r = NextRandom32(state);
+    uint16_t target = PROGRAM_START + 2 * (NextRandom32(state) % words);
+    uint16_t low = r & 0x0FFF;
+    // One in 32 is anything at all.
+    if (r >> 27 == 0) {
+        return NextRandom32(state);
+    }
+    switch (r >> 28) {
+        case 0x0: {
+            return r & 0x100 ? 0x00E0 : 0x00EE;
+        }
+        case 0x1:
+        case 0x2: {
+            return (r >> 28) << 12 | target;
+        }
+        case 0x8: {
+            const uint8_t alu_ops[] = {0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE};
+            return 0x8000 | (low & 0x0FF0) | alu_ops[NextRandom32(state) % sizeof(alu_ops)];
+        }
+        case 0xA: {
+            // Mostly point I into the program or fonts so draws and stores stay in range.
+            return 0xA000 | (r & 0x800 ? low : target);
+        }
+        case 0xE: {
+            return 0xE000 | (low & 0x0F00) | (r & 0x80 ? 0x9E : 0xA1);
+        }
+        case 0xF: {
+            return 0xF000 | (low & 0x0F00) | f_ops[NextRandom32(state) % sizeof(f_ops)];
+        }
+        default: {
+            return (r >> 28) << 12 | low;
+        }
+    }
+}
+
+void Usage() {
+    fprintf(stderr, "usage: difftest [-n programs] [-f frames] [-s seed] [rom-file...]\n");
+    fprintf(stderr, "  Runs each ROM under every quirk profile, or, without ROMs, that many random programs\n");
+    fprintf(stderr, "  (default %d), for the given frames (default %d). A failing random program is rerun\n", DEFAULT_PROGRAMS, DEFAULT_FRAMES);
+    fprintf(stderr, "  with -n 1 and the seed it reports.\n");
+    fflush(stderr);
+    return ;
+}
+
+int main(int argc, char** argv) {
+    unsigned long programs = DEFAULT_PROGRAMS;
+    unsigned long frames = DEFAULT_FRAMES;
+    uint32_t seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:s:")) != -1) {
+        switch (opt) {
+            case 'n': {
+                programs = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'f': {
+                frames = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 's': {
+                seed = strtoul(optarg, NULL, 0);
+                break;
+            }
+            default: {
+                Usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    static Chip8 initial;
+    uint64_t compared = 0;
+    unsigned long runs = 0;
+    if (optind < argc) {
+        const uint8_t profiles[] = {QUIRKS_DEFAULT, QUIRKS_VIP, QUIRKS_SCHIP};
+        for (int arg = optind; arg < argc; ++arg) {
+            Rom rom;
+            RomInit(&rom, argv[arg]);
+            for (size_t p = 0; p < sizeof(profiles); ++p) {
+                InitCHIP8(&initial);
+                initial.quirks = profiles[p];
+                SeedRandom(&initial, seed);
+                if (!LoadProgram(&initial, rom.data, rom.size)) {
+                    fprintf(stderr, "%s: rom is %zu bytes, only %d fit in ram\n", argv[arg], rom.size, NUM_RAM - PROGRAM_START);
+                    exit(EXIT_FAILURE);
+                }
+                char name[512];
+                snprintf(name, sizeof(name), "%s (quirks 0x%02x)", argv[arg], profiles[p]);
+                if (!RunLockstep(name, &initial, frames, seed, &compared)) {
+                    exit(EXIT_FAILURE);
+                }
+                ++runs;
+            }
+            free(rom.data);
+        }
+    } else {
+        for (unsigned long k = 0; k < programs; ++k) {
+            uint32_t program_seed = seed + k;
+            uint32_t state = program_seed * 2654435761u | 1;
+            uint8_t program[2 * RANDOM_PROGRAM_WORDS];
+            for (size_t w = 0; w < RANDOM_PROGRAM_WORDS; ++w) {
+                uint16_t instruction = RandomInstruction(&state, RANDOM_PROGRAM_WORDS);
+                program[2 * w] = instruction >> 8;
+                program[2 * w + 1] = instruction & 0xFF;
+            }
+            InitCHIP8(&initial);
+            initial.quirks = NextRandom32(&state) & 0x1F;
+            SeedRandom(&initial, program_seed);
+            LoadProgram(&initial, program, sizeof(program));
+            char name[64];
+            snprintf(name, sizeof(name), "random program, seed %" PRIu32 " (quirks 0x%02x)", program_seed, initial.quirks);
+            if (!RunLockstep(name, &initial, frames, program_seed, &compared)) {
+                exit(EXIT_FAILURE);
+            }
+            ++runs;
+        }
+    }
+    printf("%lu runs, %" PRIu64 " instructions compared, no divergence\n", runs, compared);
+    exit(EXIT_SUCCESS);
+}
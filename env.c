@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "env.h"
+
+struct EnvBatch {
+    EnvConfig config;
+    uint32_t count;
+    // A machine with the ROM loaded and never run. Resetting an env is one copy of it.
+    Chip8 template;
+    Chip8* machines;
+    // Per env: the score at the end of the last step, frames since reset and EnvDone bits.
+    float* scores;
+    uint32_t* frames;
+    uint8_t* done;
+};
+
+void EnvDefaults(EnvConfig* config) {
+    memset(config, 0, sizeof(EnvConfig));
+    config->frames_per_step = 4;
+    config->cycles_per_frame = CYCLES_PER_FRAME;
+    config->quirks = QUIRKS_DEFAULT;
+    config->score = EnvRamScore;
+    return ;
+}
+
+float EnvRamScore(const Chip8* machine, const EnvConfig* config) {
+    return machine->ram[config->score_addr & ADDR_MASK];
+}
+
+EnvBatch* EnvCreate(const EnvConfig* config, const uint8_t* rom, size_t rom_size, uint32_t count) {
+    if (config->frames_per_step == 0 || config->cycles_per_frame == 0 || config->score == NULL || count == 0) {
+        return NULL;
+    }
+    EnvBatch* batch = calloc(1, sizeof(EnvBatch));
+    if (batch == NULL) {
+        return NULL;
+    }
+    batch->config = *config;
+    batch->count = count;
+    InitCHIP8(&batch->template);
+    batch->template.cycles_per_frame = config->cycles_per_frame;
+    batch->template.quirks = config->quirks;
+    batch->machines = calloc(count, sizeof(Chip8));
+    batch->scores = calloc(count, sizeof(float));
+    batch->frames = calloc(count, sizeof(uint32_t));
+    batch->done = calloc(count, sizeof(uint8_t));
+    if (!LoadProgram(&batch->template, rom, rom_size) || batch->machines == NULL || batch->scores == NULL
+        || batch->frames == NULL || batch->done == NULL) {
+        EnvDestroy(batch);
+        return NULL;
+    }
+    memset(batch->done, ENV_TERMINATED, count);
+    return batch;
+}
+
+void EnvDestroy(EnvBatch* batch) {
+    if (batch == NULL) {
+        return ;
+    }
+    free(batch->machines);
+    free(batch->scores);
+    free(batch->frames);
+    free(batch->done);
+    free(batch);
+    return ;
+}
+
+uint32_t EnvCount(const EnvBatch* batch) {
+    return batch->count;
+}
+
+Chip8* EnvMachine(EnvBatch* batch, uint32_t env) {
+    assert(env < batch->count);
+    return &batch->machines[env];
+}
+
+void EnvReset(EnvBatch* batch, const uint32_t* seeds, const uint8_t* mask, uint8_t* obs) {
+    for (uint32_t env = 0; env < batch->count; ++env) {
+        if (mask != NULL && mask[env] == 0) {
+            continue;
+        }
+        Chip8* machine = &batch->machines[env];
+        memcpy(machine, &batch->template, sizeof(Chip8));
+        SeedRandom(machine, seeds != NULL ? seeds[env] : 0);
+        batch->scores[env] = batch->config.score(machine, &batch->config);
+        batch->frames[env] = 0;
+        batch->done[env] = 0;
+        if (obs != NULL) {
+            memcpy(obs + (size_t)env * DISPLAY_BYTES, machine->logical_pixels, DISPLAY_BYTES);
+        }
+    }
+    return ;
+}
+
+void EnvStep(EnvBatch* batch, const uint16_t* actions, uint8_t* obs, float* rewards, uint8_t* done) {
+    const EnvConfig* config = &batch->config;
+    for (uint32_t env = 0; env < batch->count; ++env) {
+        Chip8* machine = &batch->machines[env];
+        float reward = 0;
+        if (batch->done[env] == 0) {
+            SetKeyMask(machine, actions[env]);
+            for (uint32_t frame = 0; frame < config->frames_per_step; ++frame) {
+                if (RunFrame(machine, 0) == RUN_FAULT) {
+                    batch->done[env] |= ENV_TERMINATED;
+                    break;
+                }
+                if (++batch->frames[env] == config->max_frames) {
+                    batch->done[env] |= ENV_TRUNCATED;
+                    break;
+                }
+            }
+            float score = config->score(machine, config);
+            reward = score - batch->scores[env];
+            batch->scores[env] = score;
+        }
+        if (obs != NULL) {
+            memcpy(obs + (size_t)env * DISPLAY_BYTES, machine->logical_pixels, DISPLAY_BYTES);
+        }
+        rewards[env] = reward;
+        done[env] = batch->done[env];
+    }
+    return ;
+}
+
+#if ENV_BENCH
+// gcc -O2 -DENV_BENCH env.c chip8.c -o envbench
+// Steps a batch of a ROM with random keys and reports the frame rate.
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s rom [envs] [steps]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    static uint8_t rom[NUM_RAM];
+    size_t rom_size = fread(rom, 1, sizeof(rom), file);
+    fclose(file);
+    uint32_t count = argc > 2 ? strtoul(argv[2], NULL, 0) : 256;
+    uint32_t steps = argc > 3 ? strtoul(argv[3], NULL, 0) : 1000;
+
+    EnvConfig config;
+    EnvDefaults(&config);
+    config.max_frames = 3600;
+    EnvBatch* batch = EnvCreate(&config, rom, rom_size, count);
+    if (batch == NULL) {
+        fprintf(stderr, "%s: cannot create %" PRIu32 " envs\n", argv[1], count);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t* seeds = calloc(count, sizeof(uint32_t));
+    uint16_t* actions = calloc(count, sizeof(uint16_t));
+    uint8_t* obs = calloc(count, DISPLAY_BYTES);
+    float* rewards = calloc(count, sizeof(float));
+    uint8_t* done = calloc(count, sizeof(uint8_t));
+    for (uint32_t env = 0; env < count; ++env) {
+        seeds[env] = env;
+    }
+    EnvReset(batch, seeds, NULL, obs);
+
+    uint32_t rng = 1;
+    uint64_t resets = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t step = 0; step < steps; ++step) {
+        for (uint32_t env = 0; env < count; ++env) {
+            rng = rng * 1664525 + 1013904223;
+            actions[env] = 1 << (rng >> 28);
+        }
+        EnvStep(batch, actions, obs, rewards, done);
+        for (uint32_t env = 0; env < count; ++env) {
+            seeds[env] += count;
+            resets += done[env] != 0;
+        }
+        EnvReset(batch, seeds, done, obs);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double frames = (double)count * steps * config.frames_per_step;
+    printf("%" PRIu32 " envs, %" PRIu32 " steps, %" PRIu64 " resets: %.0f frames/s\n", count, steps, resets, frames / seconds);
+
+    EnvDestroy(batch);
+    free(seeds);
+    free(actions);
+    free(obs);
+    free(rewards);
+    free(done);
+    exit(EXIT_SUCCESS);
+}
+#endif
@@ -0,0 +1,69 @@
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chip8.h"
+
+// A batch of machines running one ROM, stepped together, for reinforcement learning. Build it
+// as a shared library with no SDL:
+//   gcc -O2 -shared -fPIC -o libchip8env.so env.c chip8.c
+// A batch holds no global state, so separate batches can be stepped from separate threads.
+
+// Returns a game's score; a step's reward is how much it rose during the step.
+typedef struct EnvConfig EnvConfig;
+typedef float (*EnvScore)(const Chip8* machine, const EnvConfig* config);
+
+struct EnvConfig {
+    // Frames run by each EnvStep; the observation is the last of them.
+    uint32_t frames_per_step;
+    uint32_t cycles_per_frame;
+    uint8_t quirks;
+    // Frames after which an episode is truncated, or 0 for no limit.
+    uint32_t max_frames;
+    // The score. EnvRamScore reads the byte at score_addr.
+    EnvScore score;
+    uint16_t score_addr;
+    // For a custom score function.
+    void* context;
+};
+
+// How an episode ended, in EnvStep's done array.
+typedef enum {
+    // The machine faulted.
+    ENV_TERMINATED = 1 << 0,
+    // The episode reached max_frames.
+    ENV_TRUNCATED = 1 << 1,
+} EnvDone;
+
+typedef struct EnvBatch EnvBatch;
+
+// Four frames per step at the default speed and quirks, scored by ram[score_addr] (0 until set).
+void EnvDefaults(EnvConfig* config);
+
+// The default score function: the unsigned byte at config->score_addr.
+float EnvRamScore(const Chip8* machine, const EnvConfig* config);
+
+// Makes count machines with rom loaded. Returns NULL if the ROM does not fit, the config is
+// invalid or memory runs out. The machines start finished: EnvReset them before stepping.
+EnvBatch* EnvCreate(const EnvConfig* config, const uint8_t* rom, size_t rom_size, uint32_t count);
+void EnvDestroy(EnvBatch* batch);
+
+uint32_t EnvCount(const EnvBatch* batch);
+
+// The machine behind env, to read registers or ram beyond the score.
+Chip8* EnvMachine(EnvBatch* batch, uint32_t env);
+
+// Restarts each env whose mask byte is nonzero (all of them if mask is NULL) from the loaded
+// ROM, with CXKK seeded from seeds[env] (0 if seeds is NULL). Writes their first observation
+// to obs, if it is not NULL.
+void EnvReset(EnvBatch* batch, const uint32_t* seeds, const uint8_t* mask, uint8_t* obs);
+
+// Holds actions[env], a key mask with bit n for key n, for frames_per_step frames on every
+// env still running. obs, if not NULL, receives count bit-packed displays of DISPLAY_BYTES
+// each, laid out as in Chip8.logical_pixels; rewards and done receive one entry per env.
+// A finished env stays as it ended, with reward 0 and its done bits, until it is reset.
+void EnvStep(EnvBatch* batch, const uint16_t* actions, uint8_t* obs, float* rewards, uint8_t* done);
+
+#endif
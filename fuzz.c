@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "chip8.h"
+
+// libFuzzer target for the core:
+//   clang -g -O1 -fsanitize=fuzzer,address,undefined fuzz.c chip8.c -o fuzz
+//   ./fuzz -jobs=$(nproc) corpus/
+// Building with -DFUZZ_STANDALONE instead gives a main that runs the inputs named on the
+// command line once each, to reproduce a crash without libFuzzer.
+//
+// An input is one byte of quirk bits, a byte n, n little-endian 16-bit key masks applied one
+// per frame in turn, and the rest is the ROM. Each input runs twice, an instruction at a time
+// and a frame at a time, and the two must end in the same state; a faulting instruction must
+// leave the machine as it was. Either failing aborts, so libFuzzer keeps the input.
+//
+// Guest program counters, instruction shapes and pc-to-pc edges are fed back to libFuzzer as
+// extra coverage counters, so it steers towards inputs that reach new guest code rather than
+// only new paths through the decoder.
+
+// Also abort on stack and memory faults, to collect ROMs that crash the guest. Illegal opcodes
+// are everywhere in random input and never count.
+#ifndef FUZZ_FAULTS
+    #define FUZZ_FAULTS 0
+#endif
+
+#define FUZZ_FRAMES 32
+#define FUZZ_MAX_KEY_MASKS 64
+
+__attribute__((used, section("__libfuzzer_extra_counters"))) uint8_t pc_coverage[NUM_RAM / 2];
+__attribute__((used, section("__libfuzzer_extra_counters"))) uint8_t opcode_coverage[16 * 256];
+__attribute__((used, section("__libfuzzer_extra_counters"))) uint8_t edge_coverage[NUM_RAM];
+
+// A freshly initialised machine, copied over the working ones instead of calling InitCHIP8.
+Chip8 template;
+bool template_ready = false;
+Chip8 stepped;
+Chip8 framed;
+
+void Check(bool ok, const char* what, const Chip8* machine) {
+    if (!ok) {
+        fprintf(stderr, "fuzz: %s\n", what);
+        PrintFault(stderr, machine);
+        abort();
+    }
+    return ;
+}
+
+// The state both runs must agree on. Cycle counters differ by design when idle loops are
+// skipped, as does frame_cycle's bookkeeping, so they are left out.
+bool SameMachine(const Chip8* a, const Chip8* b) {
+    return a->pc == b->pc && a->reg_i == b->reg_i && a->sp == b->sp && a->fault == b->fault
+           && a->delay_reg == b->delay_reg && a->sound_reg == b->sound_reg && a->rng == b->rng
+           && memcmp(a->registers, b->registers, NUM_REG) == 0
+           && memcmp(a->stack, b->stack, sizeof(a->stack)) == 0
+           && memcmp(a->ram, b->ram, NUM_RAM) == 0
+           && memcmp(a->logical_pixels, b->logical_pixels, DISPLAY_BYTES) == 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size < 2) {
+        return 0;
+    }
+    if (!template_ready) {
+        InitCHIP8(&template);
+        template_ready = true;
+    }
+    uint8_t quirks = data[0] & 0x1F;
+    size_t nkeys = data[1] % (FUZZ_MAX_KEY_MASKS + 1);
+    if (size < 2 + 2 * nkeys) {
+        return 0;
+    }
+    const uint8_t* keys = data + 2;
+    const uint8_t* rom = keys + 2 * nkeys;
+    size_t rom_size = size - 2 - 2 * nkeys;
+    if (rom_size > NUM_RAM - PROGRAM_START) {
+        return 0;
+    }
+
+    memcpy(&stepped, &template, sizeof(Chip8));
+    memcpy(&stepped.ram[PROGRAM_START], rom, rom_size);
+    stepped.quirks = quirks;
+    memcpy(&framed, &stepped, sizeof(Chip8));
+
+    // An instruction at a time, recording coverage.
+    uint16_t prev_pc = stepped.pc;
+    for (uint32_t frame = 0; frame < FUZZ_FRAMES && stepped.fault == FAULT_NONE; ++frame) {
+        SetKeyMask(&stepped, nkeys > 0 ? keys[2 * (frame % nkeys)] | keys[2 * (frame % nkeys) + 1] << 8 : 0);
+        for (uint32_t cycle = 0; cycle < stepped.cycles_per_frame; ++cycle) {
+            uint16_t pc = stepped.pc & ADDR_MASK;
+            uint16_t instruction = stepped.ram[(pc + 1) & ADDR_MASK] | stepped.ram[pc] << 8;
+            ++pc_coverage[pc / 2];
+            ++opcode_coverage[(instruction >> 12) << 8 | (instruction & 0xFF)];
+            ++edge_coverage[(prev_pc * 31 ^ pc) & ADDR_MASK];
+            prev_pc = pc;
+
+            uint8_t registers[NUM_REG];
+            memcpy(registers, stepped.registers, NUM_REG);
+            uint16_t reg_i = stepped.reg_i;
+            uint8_t sp = stepped.sp;
+            if (EmulateCycle(&stepped) != FAULT_NONE) {
+                Check(stepped.pc == pc && stepped.sp == sp && stepped.reg_i == reg_i && memcmp(registers, stepped.registers, NUM_REG) == 0,
+                      "faulting instruction changed the machine", &stepped);
+                Check(!FUZZ_FAULTS || stepped.fault == FAULT_ILLEGAL_OPCODE, "guest fault", &stepped);
+                break;
+            }
+            Check(stepped.sp <= NUM_STACK, "stack pointer out of range", &stepped);
+            Check(stepped.pc <= ADDR_MASK, "pc out of range", &stepped);
+        }
+        if (stepped.fault == FAULT_NONE) {
+            TickTimers(&stepped);
+        }
+    }
+
+    // A frame at a time, through the fast path.
+    for (uint32_t frame = 0; frame < FUZZ_FRAMES && framed.fault == FAULT_NONE; ++frame) {
+        SetKeyMask(&framed, nkeys > 0 ? keys[2 * (frame % nkeys)] | keys[2 * (frame % nkeys) + 1] << 8 : 0);
+        RunFrame(&framed, 0);
+    }
+    Check(SameMachine(&stepped, &framed), "RunFrame and EmulateCycle disagree", &framed);
+    return 0;
+}
+
+#if FUZZ_STANDALONE
+int main(int argc, char** argv) {
+    for (int arg = 1; arg < argc; ++arg) {
+        FILE* file = fopen(argv[arg], "rb");
+        if (file == NULL) {
+            perror(argv[arg]);
+            exit(EXIT_FAILURE);
+        }
+        static uint8_t data[2 + 2 * FUZZ_MAX_KEY_MASKS + NUM_RAM];
+        size_t size = fread(data, 1, sizeof(data), file);
+        fclose(file);
+        LLVMFuzzerTestOneInput(data, size);
+        printf("%s: ok\n", argv[arg]);
+    }
+    exit(EXIT_SUCCESS);
+}
+#endif
@@ -11,530 +11,24 @@
 #include <inttypes.h>
 #include <SDL.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <limits.h>
+#include <endian.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <strings.h>
 
-#define SCREEN_WIDTH 640
-#define SCREEN_HEIGHT 480
-#define RESOLUTION_WIDTH 64
-#define RESOLUTION_HEIGHT 32
-
-#ifndef DEBUG
-    #define DEBUG 0
-#endif
-
-// Debug printing macro function.
-// https://stackoverflow.com/questions/1644868/define-macro-for-debug-printing-in-c
-#define DPRINT(...) \
-    do { if (DEBUG) printf(__VA_ARGS__); } while (0)
-
-#define NUM_RAM 4096
-#define NUM_REG 16
-#define NUM_STACK 16
-#define VF 15
-#define NUM_FONTS 16
-#define FONT_SIZE 5
-#define MAX_SPRITE_SIZE_BYTES 15
-
-uint8_t ram[NUM_RAM];
-uint16_t stack[NUM_STACK];
-
-
-uint8_t registers[NUM_REG];
-uint16_t reg_i;
-uint8_t delay_reg;
-uint8_t sound_reg;
-
-uint16_t pc;
-uint8_t sp;
-
-uint8_t fonts[NUM_FONTS][FONT_SIZE] = {
-    {
-        0b11110000,
-        0b10010000,
-        0b10010000,
-        0b10010000,
-        0b11110000,
-    },
-    {
-        0b00100000,
-        0b01100000,
-        0b00100000,
-        0b00100000,
-        0b01110000,
-    },
-    {
-        0b11110000,
-        0b00010000,
-        0b11110000,
-        0b10000000,
-        0b11110000,
-    },
-    {
-        0b11110000,
-        0b00010000,
-        0b11110000,
-        0b00010000,
-        0b11110000,
-    },
-    {
-        0b10010000,
-        0b10010000,
-        0b11110000,
-        0b00010000,
-        0b00010000,
-    },
-    {
-        0b11110000,
-        0b10000000,
-        0b11110000,
-        0b00010000,
-        0b11110000,
-    },
-    {
-        0b11110000,
-        0b10000000,
-        0b11110000,
-        0b10010000,
-        0b11110000,
-    },
-    {
-        0b11110000,
-        0b00010000,
-        0b00100000,
-        0b01000000,
-        0b01000000,
-    },
-    {
-        0b11110000,
-        0b10010000,
-        0b11110000,
-        0b10010000,
-        0b11110000,
-    },
-    {
-        0b11110000,
-        0b10010000,
-        0b11110000,
-        0b00010000,
-        0b11110000,
-    },
-    {
-        0b11110000,
-        0b10010000,
-        0b11110000,
-        0b10010000,
-        0b10010000,
-    },
-    {
-        0b11100000,
-        0b10010000,
-        0b11100000,
-        0b10010000,
-        0b11100000,
-    },
-    {
-        0b11110000,
-        0b10000000,
-        0b10000000,
-        0b10000000,
-        0b11110000,
-    },
-    {
-        0b11100000,
-        0b10010000,
-        0b10010000,
-        0b10010000,
-        0b11100000,
-    },
-    {
-        0b11110000,
-        0b10000000,
-        0b11110000,
-        0b10000000,
-        0b11110000,
-    },
-    {
-        0b11110000,
-        0b10000000,
-        0b11110000,
-        0b10000000,
-        0b10000000,
-    }
-};
-
-bool logical_pixels[RESOLUTION_HEIGHT][RESOLUTION_WIDTH];
-
-typedef enum {
-    KEY_0,
-    KEY_1,
-    KEY_2,
-    KEY_3,
-    KEY_4,
-    KEY_5,
-    KEY_6,
-    KEY_7,
-    KEY_8,
-    KEY_9,
-    KEY_A,
-    KEY_B,
-    KEY_C,
-    KEY_D,
-    KEY_E,
-    KEY_F,
-    KEY_UNKNOWN
-} Key;
-
-#define NUM_KEYS 17
-
-bool keys[NUM_KEYS];
-
-Key ReadInput();
-
-
-void InitCHIP8() {
-    memset(registers, 0, NUM_REG);
-    reg_i = 0;
-    delay_reg = 0;
-    sound_reg = 0;
-    pc = 0x200;  // End of reserved mem.
-    sp = 0; 
-    memset(ram, 0, NUM_RAM);
-    memset(stack, 0, NUM_STACK * sizeof(uint16_t));
-    memcpy(ram, fonts, NUM_FONTS * FONT_SIZE * sizeof(uint8_t));
-    return ;
-}
-
-void EmulateCycle() {
-    // CHIP-8 instructions are big endian encoded.
-    uint16_t instruction = ram[pc + 1] << 0 | ram[pc] << 8;
-    printf("pc: %d; instruction: 0x%04" PRIx16 "\n", pc, instruction);
-    switch (instruction & 0xF000) {
-        case 0x0000: {
-            switch (instruction) {
-                case 0x00E0: {
-                    memset(logical_pixels, false, RESOLUTION_WIDTH * RESOLUTION_HEIGHT * sizeof(bool));
-                    pc += 2;
-                    DPRINT("CLS\n");
-                    break;
-                }
-                case 0x00EE: {
-                    // TODO: Is this the right order of operations?
-                    assert(sp > 0);
-                    --sp;
-                    pc = stack[sp] + 2;  // Need to increment so I'm not stuck in an infinite loop?
-                    DPRINT("RET\n");
-                    break;
-                }
-                default: {
-                    uint16_t addr = instruction & 0x0FFF;
-                    DPRINT("SYS %d\n", addr);
-                    assert(false);
-                }
-            }
-            break;
-        }
-        case 0x1000: {
-            uint16_t addr = instruction & 0x0FFF;
-            pc = addr;
-            DPRINT("JP %d\n", addr);
-            break;
-        }
-        case 0x2000: {
-            // TODO: Is this the right order of operations?
-            uint16_t addr = instruction & 0x0FFF;
-            assert(sp < NUM_STACK);
-            stack[sp] = pc;
-            ++sp;
-            pc = addr;
-            DPRINT("CALL %d\n", addr);
-            break;
-        }
-        case 0x3000: {
-            uint8_t reg = (instruction & 0x0F00) >> 8;
-            assert(reg < NUM_REG);
-            uint8_t val = instruction & 0x00FF;
-            pc += registers[reg] == val ? 4 : 2;
-            DPRINT("SE V%d, %d\n", reg, val);
-            break;
-        }
-        case 0x4000: {
-            uint8_t reg = (instruction & 0x0F00) >> 8;
-            assert(reg < NUM_REG);
-            uint8_t val = instruction & 0x00FF;
-            pc += registers[reg] != val ? 4 : 2;
-            DPRINT("SNE V%d, %d\n", reg, val);
-            break;
-        }
-        case 0x5000: {
-            uint8_t lreg = (instruction & 0x0F00) >> 8;
-            uint8_t rreg = (instruction & 0x00F0) >> 4;
-            assert(lreg < NUM_REG);
-            assert(rreg < NUM_REG);
-            pc += registers[lreg] == registers[rreg] ? 4 : 2;
-            DPRINT("SE V%d, V%d\n", lreg, rreg);
-            break;
-        }
-        case 0x6000: {
-            uint8_t reg = (instruction & 0x0F00) >> 8;
-            assert(reg < NUM_REG);
-            uint8_t val = instruction & 0x00FF;
-            registers[reg] = val;
-            pc += 2;
-            DPRINT("LD V%d, %d\n", reg, val);
-            break;
-        }
-        case 0x7000: {
-            uint8_t reg = (instruction & 0x0F00) >> 8;
-            assert(reg < NUM_REG);
-            uint8_t val = instruction & 0x00FF;
-            registers[reg] += val;
-            pc += 2;
-            DPRINT("ADD V%d, %d\n", reg, val);
-            break;
-        }
-        case 0x8000: {
-            uint8_t lreg = (instruction & 0x0F00) >> 8;
-            uint8_t rreg = (instruction & 0x00F0) >> 4;
-            assert(lreg < NUM_REG);
-            assert(rreg < NUM_REG);
-            switch (instruction & 0x000F) {
-                case 0x0000: {
-                    registers[lreg] = registers[rreg];
-                    pc += 2;
-                    DPRINT("LD V%d, V%d\n", lreg, rreg);
-                    break;
-                }
-                case 0x0001: {
-                    registers[lreg] |= registers[rreg];
-                    pc += 2;
-                    DPRINT("OR V%d, V%d\n", lreg, rreg);
-                    break;
-                }
-                case 0x0002: {
-                    registers[lreg] &= registers[rreg];
-                    pc += 2;
-                    DPRINT("AND V%d, V%d\n", lreg, rreg);
-                    break;
-                }
-                case 0x0003: {
-                    registers[lreg] ^= registers[rreg];
-                    pc += 2;
-                    DPRINT("XOR V%d, V%d\n", lreg, rreg);
-                    break;
-                }
-                case 0x0004: {
-                    registers[VF] = 255 - registers[lreg] < registers[rreg] ? 1 : 0;
-                    registers[lreg] += registers[rreg];
-                    pc += 2;
-                    DPRINT("ADD V%d, V%d\n", lreg, rreg);
-                    break;
-                }
-                case 0x0005: {
-                    registers[VF] = registers[lreg] > registers[rreg] ? 1 : 0;
-                    registers[lreg] -= registers[rreg];
-                    pc += 2;
-                    DPRINT("SUB V%d, V%d\n", lreg, rreg);
-                    break;
-                }
-                case 0x0006: {
-                    registers[VF] = registers[lreg] & 0x01;
-                    registers[lreg] >>= 1;
-                    pc += 2;
-                    DPRINT("SHR V%d {, V%d}\n", lreg, rreg);
-                    break;
-                }
-                case 0x0007: {
-                    registers[VF] = registers[rreg] > registers[lreg] ? 1 : 0;
-                    registers[lreg] = registers[rreg] - registers[lreg];
-                    pc += 2;
-                    DPRINT("SUBN V%d, V%d\n", lreg, rreg);
-                    break;
-                }
-                case 0x000E: {
-                    registers[VF] = (registers[lreg] & 0x80) >> 7;
-                    registers[lreg] <<= 1;
-                    pc += 2;
-                    DPRINT("SHL V%d {, V%d}\n", lreg, rreg);
-                    break;
-                }
-                default: {
-                    fprintf(stderr, "unknown 0x80 instruction: %04" PRIx16 "\n", instruction);
-                    fflush(stderr);
-                    exit(EXIT_FAILURE);
-                }
-            }
-            break;
-        }
-        case 0x9000: {
-            uint8_t lreg = (instruction & 0x0F00) >> 8;
-            uint8_t rreg = (instruction & 0x00F0) >> 4;
-            assert(lreg < NUM_REG);
-            assert(rreg < NUM_REG);
-            pc += registers[lreg] != registers[rreg] ? 4 : 2;
-            DPRINT("SNE V%d, V%d\n", lreg, rreg);
-            break;
-        }
-        case 0xA000: {
-            uint16_t addr = instruction & 0x0FFF;
-            reg_i = addr;
-            pc += 2;
-            DPRINT("LD I, %d\n", addr);
-            break;
-        }
-        case 0xB000: {
-            uint16_t addr = instruction & 0x0FFF;
-            pc = addr + registers[0];
-            DPRINT("JP V0, %d\n", addr);
-            break;
-        }
-        case 0xC000: {
-            uint8_t reg = (instruction & 0x0F00) >> 8;
-            assert(reg < NUM_REG);
-            uint8_t val = instruction & 0x00FF;
-            registers[reg] = (rand() % 255) & val;
-            pc += 2;
-            DPRINT("RND V%d, %d\n", reg, val);
-            break;
-        }
-        case 0xD000: {
-            uint8_t lreg = (instruction & 0x0F00) >> 8;
-            uint8_t rreg = (instruction & 0x00F0) >> 4;
-            assert(lreg < NUM_REG);
-            assert(rreg < NUM_REG);
-            uint8_t nbytes = instruction & 0x000F;
-            assert (nbytes <= MAX_SPRITE_SIZE_BYTES);
-            registers[VF] = 0;
-            for (size_t i = reg_i, y = registers[rreg] % RESOLUTION_HEIGHT; i < reg_i + nbytes; ++i, y = (y + 1) % RESOLUTION_HEIGHT) {
-                uint8_t sprite_byte = ram[i];
-                for (uint8_t pos = 8, x = registers[lreg] % RESOLUTION_WIDTH; pos > 0; --pos, x = (x + 1) % RESOLUTION_WIDTH) {
-                    bool signal = (sprite_byte >> (pos - 1)) & 0x01;
-                    bool result = logical_pixels[y][x] ^ signal;
-                    registers[VF] = registers[VF] || (logical_pixels[y][x] && !result) ? 1 : 0;
-                    logical_pixels[y][x] = result; 
-                }
-            }
-            pc += 2;
-            DPRINT("DRW V%d, V%d, %d\n", lreg, rreg, nbytes);
-            break;
-        }
-        case 0xE000: {
-            uint8_t reg = (instruction & 0x0F00) >> 8;
-            assert(reg < NUM_REG);
-            switch (instruction & 0x00FF) {
-                case 0x009E: {
-                    pc += keys[registers[reg]] ? 4 : 2;
-                    DPRINT("SKP V%d\n", reg);
-                    break;
-                }
-                case 0x00A1: {
-                    pc += !keys[registers[reg]] ? 4 : 2;
-                    DPRINT("SKNP V%d\n", reg);
-                    break;
-                }
-                default: {
-                    fprintf(stderr, "unknown 0xE0 instruction: %04" PRIx16 "\n", instruction);
-                    fflush(stderr);
-                    exit(EXIT_FAILURE);
-                }
-            }
-            break;
-        }
-        case 0xF000: {
-            uint8_t reg = (instruction & 0x0F00) >> 8;
-            assert(reg < NUM_REG);
-            switch (instruction & 0x00FF) {
-                case 0x0007: {
-                    registers[reg] = delay_reg;
-                    pc += 2;
-                    DPRINT("LD V%d, DT\n", reg);
-                    break;
-                }
-                case 0x000A: {
-                    Key key = ReadInput();
-                    while (key == KEY_UNKNOWN) {
-                        key = ReadInput();
-                    }
-                    registers[reg] = key;
-                    DPRINT("LD V%d, K\n", reg);
-                    break;
-                }
-                case 0x0015: {
-                    delay_reg = registers[reg];
-                    pc += 2;
-                    DPRINT("LD DT, V%d\n", reg);
-                    break;
-                }
-                case 0x0018: {
-                    sound_reg = registers[reg];
-                    pc += 2;
-                    DPRINT("LD ST, V%d\n", reg);
-                    break;
-                }
-                case 0x001E: {
-                    reg_i += registers[reg];
-                    pc += 2;
-                    DPRINT("ADD I, V%d\n", reg);
-                    break;
-                }
-                case 0x0029: {
-                    uint8_t font_idx = registers[reg];
-                    assert(font_idx < NUM_FONTS);
-                    reg_i = font_idx * FONT_SIZE;
-                    pc += 2;
-                    DPRINT("LD F, V%d\n", reg);
-                    break;
-                }
-                case 0x0033: {
-                    uint8_t val = registers[reg];
-                    ram[reg_i + 2] = val % 10;
-                    val /= 10;
-                    ram[reg_i + 1] = val % 10;
-                    val /= 10;
-                    ram[reg_i] = val;
-                    pc += 2;
-                    DPRINT("LD B, V%d\n", reg);
-                    break;
-                }
-                case 0x0055: {
-                    uint16_t addr = reg_i;
-                    // TODO: implement as memcpy.
-                    for (uint8_t i = 0; i <= reg; ++i, ++addr) {
-                        ram[addr] = registers[i];
-                    }
-                    pc += 2;
-                    DPRINT("LD [I], V%d\n", reg);
-                    break;
-                }
-                case 0x0065: {
-                    uint16_t addr = reg_i;
-                    for (uint8_t i = 0; i <= reg; ++i, ++addr) {
-                        registers[i] = ram[addr];
-                    }
-                    pc += 2;
-                    DPRINT("LD V%d, [I]\n", reg);
-                    break;
-                }
-                default: {
-                    fprintf(stderr, "unknown 0xF0 instruction: %04" PRIx16 "\n", instruction);
-                    fflush(stderr);
-                    exit(EXIT_FAILURE);
-                }
-            }
-            break;
-        }
-        default: {
-            fprintf(stderr, "unknown instruction: %04" PRIx16 "\n", instruction);
-            fflush(stderr);
-            exit(EXIT_FAILURE);
-        }
-    }
-    // This is hacky for the moment. I should tie this to the framterate/clock somehow.
-    if (delay_reg > 0) {
-        --delay_reg;
-    }
-    return ;
-}
-
-
+#include "chip8.h"
 
 typedef struct {
     uint8_t* data;
@@ -579,38 +73,646 @@ void RomInit(Rom* rom, const char* filename) {
     return ;
 }
 
+// Interactive debugger, driven by line commands from stdin or a local TCP socket. Nothing
+// here runs unless a debugger is attached, and per-instruction checks only happen while a
+// breakpoint, watchpoint or step is armed; otherwise frames go straight to EmulateCycle.
+
+// Watchpoints are flagged per 256-byte page first so most accesses are rejected by one load.
+#define DEBUG_PAGE_SIZE 256
+#define DEBUG_PAGES (NUM_RAM / DEBUG_PAGE_SIZE)
+
+typedef enum {
+    WATCH_READ = 1,
+    WATCH_WRITE = 2,
+} WatchKind;
+
+typedef struct {
+    bool enabled;
+    // Whether any breakpoint, watchpoint or step needs checking before each instruction.
+    bool armed;
+    FILE* in;
+    FILE* out;
+    uint64_t breakpoints[NUM_RAM / 64];
+    size_t num_breakpoints;
+    uint8_t watch_pages[DEBUG_PAGES];
+    uint8_t watch[NUM_RAM];
+    size_t num_watchpoints;
+    bool stepping;
+    unsigned long steps_left;
+    bool stepping_over;
+    uint16_t step_over_pc;
+    uint8_t step_over_sp;
+    // Set when resuming so the breakpoint we stopped on does not fire again immediately.
+    bool skip_breakpoint;
+} Debugger;
+
+Debugger debugger;
+
+void DebuggerUpdateArmed() {
+    debugger.armed = debugger.num_breakpoints > 0 || debugger.num_watchpoints > 0 || debugger.stepping || debugger.stepping_over;
+    return ;
+}
+
+bool IsBreakpoint(uint16_t addr) {
+    return (debugger.breakpoints[addr / 64] >> (addr % 64)) & 0x01;
+}
+
+void SetBreakpoint(uint16_t addr, bool set) {
+    addr %= NUM_RAM;
+    if (IsBreakpoint(addr) == set) {
+        return ;
+    }
+    debugger.breakpoints[addr / 64] ^= (uint64_t)1 << (addr % 64);
+    debugger.num_breakpoints += set ? 1 : -1;
+    DebuggerUpdateArmed();
+    return ;
+}
+
+void SetWatchpoint(uint16_t addr, uint16_t len, uint8_t kinds) {
+    for (uint16_t i = 0; i < len && addr + i < NUM_RAM; ++i) {
+        uint16_t a = addr + i;
+        if ((debugger.watch[a] == 0) != (kinds == 0)) {
+            debugger.num_watchpoints += kinds != 0 ? 1 : -1;
+        }
+        debugger.watch[a] = kinds;
+    }
+    for (size_t page = addr / DEBUG_PAGE_SIZE; page < DEBUG_PAGES && page * DEBUG_PAGE_SIZE < (size_t)addr + len; ++page) {
+        debugger.watch_pages[page] = 0;
+        for (size_t a = page * DEBUG_PAGE_SIZE; a < (page + 1) * DEBUG_PAGE_SIZE; ++a) {
+            debugger.watch_pages[page] |= debugger.watch[a];
+        }
+    }
+    DebuggerUpdateArmed();
+    return ;
+}
+
+// Returns the first watched address in [addr, addr + len) matching kind, or -1.
+int FindWatched(uint16_t addr, uint16_t len, WatchKind kind) {
+    for (size_t a = addr; a < (size_t)addr + len && a < NUM_RAM; ++a) {
+        if ((debugger.watch_pages[a / DEBUG_PAGE_SIZE] & kind) && (debugger.watch[a] & kind)) {
+            return a;
+        }
+    }
+    return -1;
+}
+
+// Decodes the instruction at pc to find which bytes of ram it will touch through I.
+bool InstructionAccess(const Chip8* machine, uint16_t instruction, uint16_t* addr, uint16_t* len, WatchKind* kind) {
+    uint8_t x = (instruction & 0x0F00) >> 8;
+    *addr = machine->reg_i;
+    if ((instruction & 0xF000) == 0xD000) {
+        *len = instruction & 0x000F;
+        *kind = WATCH_READ;
+        return true;
+    }
+    if ((instruction & 0xF000) != 0xF000) {
+        return false;
+    }
+    switch (instruction & 0x00FF) {
+        case 0x0033: {
+            *len = 3;
+            *kind = WATCH_WRITE;
+            return true;
+        }
+        case 0x0055: {
+            *len = x + 1;
+            *kind = WATCH_WRITE;
+            return true;
+        }
+        case 0x0065: {
+            *len = x + 1;
+            *kind = WATCH_READ;
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+void PrintRegisters(const Chip8* machine) {
+    fprintf(debugger.out, "pc=%03" PRIx16 " [%02x%02x] i=%03" PRIx16 " sp=%d dt=%d st=%d\n", machine->pc, machine->ram[machine->pc % NUM_RAM], machine->ram[(machine->pc + 1) % NUM_RAM], machine->reg_i, machine->sp, machine->delay_reg, machine->sound_reg);
+    for (int i = 0; i < NUM_REG; ++i) {
+        fprintf(debugger.out, "V%X=%02x%s", i, machine->registers[i], i % 8 == 7 ? "\n" : " ");
+    }
+    return ;
+}
+
+void PrintStack(const Chip8* machine) {
+    if (machine->sp == 0) {
+        fprintf(debugger.out, "stack empty\n");
+    }
+    for (int i = machine->sp - 1; i >= 0; --i) {
+        fprintf(debugger.out, "#%d %03" PRIx16 "\n", machine->sp - 1 - i, machine->stack[i]);
+    }
+    return ;
+}
+
+void PrintMemory(const Chip8* machine, uint16_t addr, uint16_t len) {
+    for (size_t row = addr; row < (size_t)addr + len && row < NUM_RAM; row += 16) {
+        fprintf(debugger.out, "%03zx:", row);
+        for (size_t a = row; a < row + 16 && a < (size_t)addr + len && a < NUM_RAM; ++a) {
+            fprintf(debugger.out, " %02x", machine->ram[a]);
+        }
+        fprintf(debugger.out, "\n");
+    }
+    return ;
+}
+
+void PrintDebuggerHelp() {
+    fprintf(debugger.out,
+            "c                continue\n"
+            "s [n]            step n instructions (default 1)\n"
+            "n                step over a CALL\n"
+            "b addr           set breakpoint\n"
+            "bd addr          delete breakpoint\n"
+            "bl               list breakpoints\n"
+            "w addr [len] [r|w|rw]  watch ram (default 1 byte, rw)\n"
+            "wd addr [len]    delete watchpoint\n"
+            "r                registers\n"
+            "st               stack\n"
+            "x addr [len]     dump ram (default 16 bytes)\n"
+            "q                quit\n"
+            "Addresses and lengths are hex. Any input while running breaks in.\n");
+    return ;
+}
+
+// Reads and runs commands until one resumes execution. Returns false to quit.
+bool DebuggerConsole(Chip8* machine, const char* reason) {
+    debugger.stepping = false;
+    debugger.steps_left = 0;
+    debugger.stepping_over = false;
+    DebuggerUpdateArmed();
+    fprintf(debugger.out, "%s\n", reason);
+    PrintRegisters(machine);
+
+    char line[256];
+    for (;;) {
+        fprintf(debugger.out, "(chip8) ");
+        fflush(debugger.out);
+        if (fgets(line, sizeof(line), debugger.in) == NULL) {
+            return false;
+        }
+        char cmd[16] = "";
+        char arg1[32] = "";
+        char arg2[32] = "";
+        char arg3[32] = "";
+        sscanf(line, "%15s %31s %31s %31s", cmd, arg1, arg2, arg3);
+        uint16_t addr = strtoul(arg1, NULL, 16) % NUM_RAM;
+        if (strcmp(cmd, "c") == 0) {
+            debugger.skip_breakpoint = true;
+            return true;
+        } else if (strcmp(cmd, "s") == 0) {
+            unsigned long n = arg1[0] != '\0' ? strtoul(arg1, NULL, 0) : 1;
+            debugger.stepping = n > 0;
+            debugger.steps_left = n;
+            debugger.skip_breakpoint = true;
+            DebuggerUpdateArmed();
+            return true;
+        } else if (strcmp(cmd, "n") == 0) {
+            uint16_t instruction = machine->ram[machine->pc & ADDR_MASK] << 8 | machine->ram[(machine->pc + 1) & ADDR_MASK];
+            if ((instruction & 0xF000) == 0x2000) {
+                // Returns land on the CALL's address + 2 with the stack back at this depth.
+                debugger.stepping_over = true;
+                debugger.step_over_pc = (machine->pc + 2) & ADDR_MASK;
+                debugger.step_over_sp = machine->sp;
+            } else {
+                debugger.stepping = true;
+                debugger.steps_left = 1;
+            }
+            debugger.skip_breakpoint = true;
+            DebuggerUpdateArmed();
+            return true;
+        } else if (strcmp(cmd, "b") == 0 && arg1[0] != '\0') {
+            SetBreakpoint(addr, true);
+        } else if (strcmp(cmd, "bd") == 0 && arg1[0] != '\0') {
+            SetBreakpoint(addr, false);
+        } else if (strcmp(cmd, "bl") == 0) {
+            for (uint16_t a = 0; a < NUM_RAM; ++a) {
+                if (IsBreakpoint(a)) {
+                    fprintf(debugger.out, "%03" PRIx16 "\n", a);
+                }
+            }
+        } else if (strcmp(cmd, "w") == 0 && arg1[0] != '\0') {
+            uint16_t len = arg2[0] != '\0' ? strtoul(arg2, NULL, 16) : 1;
+            uint8_t kinds = WATCH_READ | WATCH_WRITE;
+            if (strcmp(arg3, "r") == 0) {
+                kinds = WATCH_READ;
+            } else if (strcmp(arg3, "w") == 0) {
+                kinds = WATCH_WRITE;
+            }
+            SetWatchpoint(addr, len, kinds);
+        } else if (strcmp(cmd, "wd") == 0 && arg1[0] != '\0') {
+            SetWatchpoint(addr, arg2[0] != '\0' ? strtoul(arg2, NULL, 16) : 1, 0);
+        } else if (strcmp(cmd, "r") == 0) {
+            PrintRegisters(machine);
+        } else if (strcmp(cmd, "st") == 0) {
+            PrintStack(machine);
+        } else if (strcmp(cmd, "x") == 0) {
+            PrintMemory(machine, arg1[0] != '\0' ? addr : machine->reg_i, arg2[0] != '\0' ? strtoul(arg2, NULL, 16) : 16);
+        } else if (strcmp(cmd, "q") == 0) {
+            return false;
+        } else if (cmd[0] != '\0') {
+            PrintDebuggerHelp();
+        }
+    }
+}
+
+// Runs up to n instructions, stopping in the console whenever a check fires, or until the
+// machine faults. Returns false if the user quit from the console.
+bool DebuggerRunCycles(Chip8* machine, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        char reason[64] = "";
+        uint16_t instruction = machine->ram[machine->pc % NUM_RAM] << 8 | machine->ram[(machine->pc + 1) % NUM_RAM];
+        uint16_t addr;
+        uint16_t len;
+        WatchKind kind;
+        int watched;
+        if (debugger.stepping && debugger.steps_left == 0) {
+            snprintf(reason, sizeof(reason), "step");
+        } else if (debugger.stepping_over && machine->pc == debugger.step_over_pc && machine->sp == debugger.step_over_sp) {
+            snprintf(reason, sizeof(reason), "step over");
+        } else if (!debugger.skip_breakpoint && IsBreakpoint(machine->pc % NUM_RAM)) {
+            snprintf(reason, sizeof(reason), "breakpoint %03" PRIx16, machine->pc);
+        } else if (debugger.num_watchpoints > 0 && InstructionAccess(machine, instruction, &addr, &len, &kind) && (watched = FindWatched(addr, len, kind)) != -1) {
+            snprintf(reason, sizeof(reason), "watchpoint %03x %s by %04" PRIx16, watched, kind == WATCH_READ ? "read" : "write", instruction);
+        }
+        debugger.skip_breakpoint = false;
+        if (reason[0] != '\0' && !DebuggerConsole(machine, reason)) {
+            return false;
+        }
+        if (EmulateCycle(machine) != FAULT_NONE) {
+            return true;
+        }
+        if (debugger.stepping) {
+            --debugger.steps_left;
+        }
+    }
+    return true;
+}
+
+// Returns whether a command line is waiting on the console, without blocking.
+bool DebuggerInputPending() {
+    struct pollfd pfd = {
+        .fd = fileno(debugger.in),
+        .events = POLLIN,
+    };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Attaches the debugger to stdin/stdout, or, if port is non-zero, to the first client that
+// connects to that port on localhost.
+void DebuggerInit(uint16_t port) {
+    memset(&debugger, 0, sizeof(Debugger));
+    debugger.enabled = true;
+    debugger.in = stdin;
+    debugger.out = stdout;
+    if (port == 0) {
+        return ;
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        perror("debugger socket");
+        exit(EXIT_FAILURE);
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd, 1) == -1) {
+        perror("debugger bind");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "waiting for debugger on 127.0.0.1:%d\n", port);
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+        perror("debugger accept");
+        exit(EXIT_FAILURE);
+    }
+    close(listen_fd);
+    debugger.in = fdopen(fd, "r");
+    debugger.out = fdopen(dup(fd), "w");
+    if (debugger.in == NULL || debugger.out == NULL) {
+        perror("debugger fdopen");
+        exit(EXIT_FAILURE);
+    }
+    return ;
+}
+
+// Offscreen frame export. None of this touches SDL, so it works the same in headless mode.
+
+bool WriteAll(int fd, const uint8_t* buf, size_t size) {
+    while (size > 0) {
+        ssize_t nwritten = write(fd, buf, size);
+        if (nwritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += nwritten;
+        size -= nwritten;
+    }
+    return true;
+}
+
+void WriteFramePPM(FILE* file, const uint8_t* frame) {
+    fprintf(file, "P6\n%d %d\n255\n", RESOLUTION_WIDTH, RESOLUTION_HEIGHT);
+    for (size_t i = 0; i < DISPLAY_BYTES; ++i) {
+        for (uint8_t pos = 8; pos > 0; --pos) {
+            uint8_t val = (frame[i] >> (pos - 1)) & 0x01 ? 0xFF : 0x00;
+            uint8_t rgb[3] = {val, val, val};
+            fwrite(rgb, sizeof(uint8_t), 3, file);
+        }
+    }
+    return ;
+}
+
+uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size) {
+    static uint32_t table[256];
+    static bool table_ready = false;
+    if (!table_ready) {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        table_ready = true;
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void WritePNGChunk(FILE* file, const char type[4], const uint8_t* data, uint32_t size) {
+    uint32_t be_size = htonl(size);
+    fwrite(&be_size, sizeof(uint32_t), 1, file);
+    fwrite(type, sizeof(char), 4, file);
+    // IEND has no data, and fwrite's buffer must not be NULL even for no bytes.
+    if (size > 0) {
+        fwrite(data, sizeof(uint8_t), size, file);
+    }
+    uint32_t crc = Crc32(0, (const uint8_t*)type, 4);
+    crc = htonl(Crc32(crc, data, size));
+    fwrite(&crc, sizeof(uint32_t), 1, file);
+    return ;
+}
+
+// Writes a 1-bit grayscale PNG. Packed display rows already are PNG scanlines, so the image
+// data is just each row prefixed with filter byte 0, wrapped in a single stored deflate block.
+void WriteFramePNG(FILE* file, const uint8_t* frame) {
+    #define PNG_SCANLINES_SIZE (RESOLUTION_HEIGHT * (1 + DISPLAY_ROW_BYTES))
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    fwrite(signature, sizeof(uint8_t), sizeof(signature), file);
+
+    uint8_t ihdr[13] = {0};
+    uint32_t width = htonl(RESOLUTION_WIDTH);
+    uint32_t height = htonl(RESOLUTION_HEIGHT);
+    memcpy(&ihdr[0], &width, 4);
+    memcpy(&ihdr[4], &height, 4);
+    ihdr[8] = 1;  // Bit depth.
+    ihdr[9] = 0;  // Grayscale.
+    WritePNGChunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+    // zlib header, stored block header (BFINAL=1, BTYPE=00, LEN, NLEN), scanlines, adler32.
+    uint8_t idat[2 + 5 + PNG_SCANLINES_SIZE + 4];
+    size_t n = 0;
+    idat[n++] = 0x78;
+    idat[n++] = 0x01;
+    idat[n++] = 0x01;
+    idat[n++] = PNG_SCANLINES_SIZE & 0xFF;
+    idat[n++] = PNG_SCANLINES_SIZE >> 8;
+    idat[n++] = ~PNG_SCANLINES_SIZE & 0xFF;
+    idat[n++] = (~PNG_SCANLINES_SIZE >> 8) & 0xFF;
+    uint32_t a = 1, b = 0;
+    for (size_t y = 0; y < RESOLUTION_HEIGHT; ++y) {
+        for (size_t i = 0; i <= DISPLAY_ROW_BYTES; ++i) {
+            uint8_t byte = i == 0 ? 0 : frame[y * DISPLAY_ROW_BYTES + i - 1];
+            idat[n++] = byte;
+            a = (a + byte) % 65521;
+            b = (b + a) % 65521;
+        }
+    }
+    uint32_t adler = htonl((b << 16) | a);
+    memcpy(&idat[n], &adler, 4);
+    n += 4;
+    WritePNGChunk(file, "IDAT", idat, n);
+    WritePNGChunk(file, "IEND", NULL, 0);
+    #undef PNG_SCANLINES_SIZE
+    return ;
+}
+
+// Writes the given frame to path, as PNG if the path ends in ".png" and as PPM otherwise.
+bool WriteFrame(const char* path, const uint8_t* frame) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    size_t len = strlen(path);
+    if (len >= 4 && strcmp(&path[len - 4], ".png") == 0) {
+        WriteFramePNG(file, frame);
+    } else {
+        WriteFramePPM(file, frame);
+    }
+    if (fclose(file) == EOF) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+#define VIDEO_RING_FRAMES 64
+
+// Streams raw 1-bit frames (ffmpeg: -f rawvideo -pixel_format monob -video_size 64x32) to a
+// file or pipe. The emulator only copies the packed display into a ring slot; opening and
+// writing happen on a background thread. When the reader falls behind, frames are dropped and
+// counted rather than stall the emulator, unless the stream was made lossless, in which case
+// the emulator waits for a free slot.
+typedef struct {
+    const char* path;
+    uint8_t frames[VIDEO_RING_FRAMES][DISPLAY_BYTES];
+    size_t head;  // Next slot to fill; only advanced by the emulator.
+    size_t tail;  // Next slot to write; only advanced by the writer.
+    size_t dropped;
+    bool lossless;
+    bool closing;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+} VideoStream;
+
+void* VideoStreamWriter(void* arg) {
+    VideoStream* stream = (VideoStream*)arg;
+    // Opening a FIFO blocks until a reader shows up, which is why it is done here.
+    int fd = strcmp(stream->path, "-") == 0 ? STDOUT_FILENO : open(stream->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(stream->path);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    for (;;) {
+        while (stream->tail == stream->head && !stream->closing) {
+            pthread_cond_wait(&stream->ready, &stream->lock);
+        }
+        if (stream->tail == stream->head) {
+            break;
+        }
+        const uint8_t* frame = stream->frames[stream->tail % VIDEO_RING_FRAMES];
+        pthread_mutex_unlock(&stream->lock);
+        if (fd != -1 && !WriteAll(fd, frame, DISPLAY_BYTES)) {
+            perror("write video frame");
+            close(fd);
+            fd = -1;
+        }
+        pthread_mutex_lock(&stream->lock);
+        ++stream->tail;
+        pthread_cond_signal(&stream->space);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    if (fd != -1 && fd != STDOUT_FILENO && close(fd) == -1) {
+        perror("close video stream");
+    }
+    return NULL;
+}
+
+void VideoStreamInit(VideoStream* stream, const char* path, bool lossless) {
+    assert(stream != NULL);
+    memset(stream, 0, sizeof(VideoStream));
+    stream->path = path;
+    stream->lossless = lossless;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->ready, NULL);
+    pthread_cond_init(&stream->space, NULL);
+    if (pthread_create(&stream->writer, NULL, VideoStreamWriter, stream) != 0) {
+        fprintf(stderr, "Failed to start video writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+    return ;
+}
+
+void VideoStreamPush(VideoStream* stream, const uint8_t* frame) {
+    pthread_mutex_lock(&stream->lock);
+    while (stream->lossless && stream->head - stream->tail == VIDEO_RING_FRAMES) {
+        pthread_cond_wait(&stream->space, &stream->lock);
+    }
+    if (stream->head - stream->tail == VIDEO_RING_FRAMES) {
+        ++stream->dropped;
+    } else {
+        memcpy(stream->frames[stream->head % VIDEO_RING_FRAMES], frame, DISPLAY_BYTES);
+        ++stream->head;
+        pthread_cond_signal(&stream->ready);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return ;
+}
+
+// Flushes any queued frames and stops the writer thread.
+void VideoStreamClose(VideoStream* stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->closing = true;
+    pthread_cond_signal(&stream->ready);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->writer, NULL);
+    if (stream->dropped > 0) {
+        fprintf(stderr, "video stream dropped %zu frames\n", stream->dropped);
+    }
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->ready);
+    pthread_cond_destroy(&stream->space);
+    return ;
+}
+
 typedef uint32_t Pixel;
 SDL_Window* window = NULL;
 SDL_Renderer* renderer = NULL;
 SDL_Texture* texture = NULL;
 Pixel pixels[RESOLUTION_WIDTH * RESOLUTION_HEIGHT];
 
+typedef enum {
+    // Expand every pixel to 32 bits on the CPU and upload through a static texture.
+    RENDER_LEGACY,
+    // Upload an 8-bit streaming texture only when the display changed, and blend it into a
+    // 64x32 render target that fades over time on the GPU. All scaling to the window happens
+    // in the final copy, so CPU cost does not depend on the window size.
+    RENDER_STREAMING
+} RenderMode;
+
+RenderMode render_mode = RENDER_LEGACY;
+// Whether presenting with vsync paces the frame loop by itself, which it only does on a display
+// refreshing at the 60 Hz frame rate.
+bool vsync_paced = false;
+SDL_Texture* phosphor = NULL;
+uint8_t uploaded_frame[DISPLAY_BYTES];
+bool frame_uploaded = false;
 
-void InitGraphics() {
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+void InitGraphics(const char* title, unsigned long scale, RenderMode mode, bool fullscreen, bool vsync) {
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER) < 0) {
         fprintf(stderr, "SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
         exit(EXIT_FAILURE);
     }
 
-    window = SDL_CreateWindow("SDL Tutorial", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+    Uint32 window_flags = SDL_WINDOW_SHOWN | (fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
+    window = SDL_CreateWindow(title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, RESOLUTION_WIDTH * scale, RESOLUTION_HEIGHT * scale, window_flags);
     if( window == NULL ){
         fprintf(stderr, "Window could not be created! SDL_Error: %s\n", SDL_GetError() );
         exit(EXIT_FAILURE);
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
     if (renderer == NULL) {
         fprintf(stderr, "Renderer could not be created! SDL Error: %s\n", SDL_GetError());
         exit(EXIT_FAILURE);
     }
 
+    if (vsync) {
+        SDL_DisplayMode display_mode = {0};
+        vsync_paced = SDL_GetWindowDisplayMode(window, &display_mode) == 0 && abs(display_mode.refresh_rate - FRAME_RATE) <= 1;
+        if (!vsync_paced) {
+            fprintf(stderr, "display refreshes at %d Hz, not %d: frames are paced by the clock and vsync only avoids tearing\n",
+                    display_mode.refresh_rate, FRAME_RATE);
+        }
+    }
+
     if (SDL_RenderSetLogicalSize(renderer, 64, 32) < 0) {
         fprintf(stderr, "Failed to set renderer logical size! SDL Error: %s\n", SDL_GetError());
         exit(EXIT_FAILURE);
     }
 
+    // Letterbox to the largest whole multiple of 64x32 so every logical pixel is the same size.
+    if (fullscreen && SDL_RenderSetIntegerScale(renderer, SDL_TRUE) < 0) {
+        fprintf(stderr, "Failed to set integer scaling! SDL Error: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
 
+    render_mode = mode;
+    if (mode == RENDER_STREAMING) {
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB332, SDL_TEXTUREACCESS_STREAMING, RESOLUTION_WIDTH, RESOLUTION_HEIGHT);
+        phosphor = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_TARGET, RESOLUTION_WIDTH, RESOLUTION_HEIGHT);
+        if (texture == NULL || phosphor == NULL) {
+            fprintf(stderr, "Texture could not be created! SDL Error: %s\n", SDL_GetError());
+            exit(EXIT_FAILURE);
+        }
+        // Lit pixels add onto whatever glow is left from previous frames.
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_ADD);
+        SDL_SetRenderTarget(renderer, phosphor);
+        SDL_RenderClear(renderer);
+        SDL_SetRenderTarget(renderer, NULL);
+        return ;
+    }
+
     texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STATIC, RESOLUTION_WIDTH, RESOLUTION_HEIGHT);
     if (texture == NULL) {
         fprintf(stderr, "Texture could not be created! SDL Error: %s\n", SDL_GetError());
@@ -624,11 +726,12 @@ void InitGraphics() {
     return ;
 }
 
-void Render() {
+void Render(const Chip8* machine) {
     // Translate logical pixels to actual pixels displayed on screen.
     for (size_t y = 0; y < RESOLUTION_HEIGHT; ++y) {
         for (size_t x = 0; x < RESOLUTION_WIDTH; ++x) {
-            pixels[(y * RESOLUTION_WIDTH) + x] = logical_pixels[y][x] ? 0x00FFFFFF : 0x00000000;
+            bool on = (machine->logical_pixels[y][x / 8] >> (7 - (x % 8))) & 0x01;
+            pixels[(y * RESOLUTION_WIDTH) + x] = on ? 0x00FFFFFF : 0x00000000;
         }
     }
     if (SDL_UpdateTexture(texture, NULL, pixels, RESOLUTION_WIDTH * sizeof(Pixel)) < 0) {
@@ -643,128 +746,2381 @@ void Render() {
         fprintf(stderr, "Failed to render copy! SDL Error: %s\n", SDL_GetError());
         exit(EXIT_FAILURE);
     }
-    SDL_RenderPresent(renderer);
     return ;
 }
 
-Key MapKeycode(SDL_Keycode code) {
-    Key key = KEY_UNKNOWN;
-    switch (code) {
-        case SDLK_1: {
-            key = KEY_1;
-            break;
-        }
-        case SDLK_2: {
-            key = KEY_2;
-            break;    
-        }
-        case SDLK_3: {
-            key = KEY_3;
-            break;
-        }
-        case SDLK_4: {
-            key = KEY_C;
-            break;
-        }
-        case SDLK_q: {
-            key = KEY_4;
-            break;
-        }
-        case SDLK_w: {
-            key = KEY_5;
-            break;
-        }
-        case SDLK_e: {
-            key = KEY_6;
-            break;
+// Renders one frame in RENDER_STREAMING mode. decay is how much of the previous frame's glow
+// (out of 255) is removed each frame; 255 disables persistence entirely.
+void RenderStreaming(const Chip8* machine, uint8_t decay) {
+    if (!frame_uploaded || memcmp(uploaded_frame, machine->logical_pixels, DISPLAY_BYTES) != 0) {
+        void* locked;
+        int pitch;
+        if (SDL_LockTexture(texture, NULL, &locked, &pitch) < 0) {
+            fprintf(stderr, "Failed to lock texture! SDL Error: %s\n", SDL_GetError());
+            exit(EXIT_FAILURE);
         }
-        case SDLK_r: {
-            key = KEY_D;
-            break;
+        for (size_t y = 0; y < RESOLUTION_HEIGHT; ++y) {
+            uint8_t* row = (uint8_t*)locked + y * pitch;
+            for (size_t x = 0; x < RESOLUTION_WIDTH; ++x) {
+                row[x] = (machine->logical_pixels[y][x / 8] >> (7 - (x % 8))) & 0x01 ? 0xFF : 0x00;
+            }
         }
-        case SDLK_a: {
-            key = KEY_7;
+        SDL_UnlockTexture(texture);
+        memcpy(uploaded_frame, machine->logical_pixels, DISPLAY_BYTES);
+        frame_uploaded = true;
+    }
+
+    if (SDL_SetRenderTarget(renderer, phosphor) < 0) {
+        fprintf(stderr, "Failed to set render target! SDL Error: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, decay);
+    SDL_RenderFillRect(renderer, NULL);
+    if (SDL_RenderCopy(renderer, texture, NULL, NULL) < 0) {
+        fprintf(stderr, "Failed to render copy! SDL Error: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+
+    SDL_SetRenderTarget(renderer, NULL);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    if (SDL_RenderClear(renderer) < 0) {
+        fprintf(stderr, "Failed to clear renderer! SDL Error: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+    if (SDL_RenderCopy(renderer, phosphor, NULL, NULL) < 0) {
+        fprintf(stderr, "Failed to render copy! SDL Error: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+    return ;
+}
+
+// Key bindings. A keymap file has one binding per line, "key <SDL scancode name> <hex digit>"
+// or "button <SDL game controller button name> <hex digit>", with # comments. It is compiled
+// into flat tables indexed by scancode and controller button, so looking up an event is one
+// load, and anything unbound maps to KEY_UNKNOWN and is ignored.
+typedef struct {
+    uint8_t scancodes[SDL_NUM_SCANCODES];
+    uint8_t buttons[SDL_CONTROLLER_BUTTON_MAX];
+} Keymap;
+
+const char default_keymap[] =
+    "key 1 1\nkey 2 2\nkey 3 3\nkey 4 C\n"
+    "key Q 4\nkey W 5\nkey E 6\nkey R D\n"
+    "key A 7\nkey S 8\nkey D 9\nkey F E\n"
+    "key Z A\nkey X 0\nkey C B\nkey V F\n"
+    "button dpup 2\nbutton dpleft 4\nbutton dpright 6\nbutton dpdown 8\n"
+    "button a 5\nbutton b 0\nbutton x 7\nbutton y 9\n";
+
+Keymap keymap;
+// Set by F5 or SIGHUP; the keymap file is re-read on the next input poll.
+volatile sig_atomic_t keymap_reload_requested = 0;
+
+char* TrimSpace(char* str) {
+    while (isspace((unsigned char)*str)) {
+        ++str;
+    }
+    char* end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) {
+        --end;
+    }
+    *end = '\0';
+    return str;
+}
+
+// Compiles bindings from file into keymap. On a bad line nothing is changed.
+bool ParseKeymap(Keymap* keymap, FILE* file, const char* source) {
+    Keymap parsed;
+    memset(&parsed, KEY_UNKNOWN, sizeof(Keymap));
+    char buf[256];
+    for (size_t line = 1; fgets(buf, sizeof(buf), file) != NULL; ++line) {
+        char* comment = strchr(buf, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char* text = TrimSpace(buf);
+        if (*text == '\0') {
+            continue;
+        }
+        // "<kind> <name, may contain spaces> <digit>"
+        char* name = strchr(text, ' ');
+        char* digit = strrchr(text, ' ');
+        char* end = NULL;
+        unsigned long key = digit != NULL ? strtoul(digit + 1, &end, 16) : 0;
+        if (name == NULL || name == digit || *end != '\0' || key > KEY_F) {
+            fprintf(stderr, "%s:%zu: expected \"key|button <name> <hex digit>\"\n", source, line);
+            return false;
+        }
+        *name++ = '\0';
+        *digit = '\0';
+        name = TrimSpace(name);
+        if (strcmp(text, "key") == 0) {
+            SDL_Scancode scancode = SDL_GetScancodeFromName(name);
+            if (scancode == 0) {
+                fprintf(stderr, "%s:%zu: unknown key \"%s\"\n", source, line, name);
+                return false;
+            }
+            parsed.scancodes[scancode] = key;
+        } else if (strcmp(text, "button") == 0) {
+            SDL_GameControllerButton button = SDL_GameControllerGetButtonFromString(name);
+            if (button == SDL_CONTROLLER_BUTTON_INVALID) {
+                fprintf(stderr, "%s:%zu: unknown controller button \"%s\"\n", source, line, name);
+                return false;
+            }
+            parsed.buttons[button] = key;
+        } else {
+            fprintf(stderr, "%s:%zu: unknown binding kind \"%s\"\n", source, line, text);
+            return false;
+        }
+    }
+    *keymap = parsed;
+    return true;
+}
+
+// Loads the keymap file, or, when there is none, the given bindings or the default QWERTY
+// layout. Returns false and keeps the current bindings if they cannot be read or parsed.
+bool LoadKeymap(const char* keymap_path, const char* text) {
+    text = text != NULL ? text : default_keymap;
+    FILE* file = keymap_path != NULL ? fopen(keymap_path, "r") : fmemopen((void*)text, strlen(text), "r");
+    if (file == NULL) {
+        perror(keymap_path != NULL ? keymap_path : "keymap");
+        return false;
+    }
+    bool ok = ParseKeymap(&keymap, file, keymap_path != NULL ? keymap_path : "keymap");
+    fclose(file);
+    return ok;
+}
+
+void RequestKeymapReload(int signum) {
+    (void)signum;
+    keymap_reload_requested = 1;
+    return ;
+}
+
+uint64_t NowNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#define FRAME_PERIOD_NS (1000000000 / FRAME_RATE)
+// A key press whose effect has not shown up on screen within this many ns is not sampled.
+#define INPUT_LATENCY_TIMEOUT_NS 1000000000
+
+typedef struct {
+    FILE* log;  // Per-frame CSV, or NULL.
+    uint64_t frames;
+    uint64_t late_frames;
+    uint64_t emulate_ns;
+    uint64_t render_ns;
+    uint64_t present_ns;
+    uint64_t max_frame_ns;
+    // The pending key press, if any, and what the display looked like when it was read.
+    uint64_t input_read_ns;
+    uint8_t input_frame[DISPLAY_BYTES];
+    uint64_t latency_samples;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+} FrameStats;
+
+void FrameStatsInit(FrameStats* stats, const char* log_path) {
+    memset(stats, 0, sizeof(FrameStats));
+    if (log_path == NULL) {
+        return ;
+    }
+    stats->log = fopen(log_path, "w");
+    if (stats->log == NULL) {
+        perror(log_path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stats->log, "frame,emulate_us,render_us,present_us,input_latency_us\n");
+    return ;
+}
+
+void FrameStatsKeyRead(FrameStats* stats, const Chip8* machine, uint64_t now) {
+    if (stats->input_read_ns == 0) {
+        stats->input_read_ns = now;
+        memcpy(stats->input_frame, machine->logical_pixels, DISPLAY_BYTES);
+    }
+    return ;
+}
+
+// Records one frame. Timestamps are taken at the start of the frame and after emulation,
+// rendering and presentation. A pending key press is resolved by the first presented frame
+// whose contents differ from the display at the time the key was read.
+void FrameStatsRecord(FrameStats* stats, const Chip8* machine, uint64_t start, uint64_t emulated, uint64_t rendered, uint64_t presented) {
+    ++stats->frames;
+    stats->emulate_ns += emulated - start;
+    stats->render_ns += rendered - emulated;
+    stats->present_ns += presented - rendered;
+    if (presented - start > stats->max_frame_ns) {
+        stats->max_frame_ns = presented - start;
+    }
+
+    uint64_t latency = 0;
+    if (stats->input_read_ns != 0 && memcmp(stats->input_frame, machine->logical_pixels, DISPLAY_BYTES) != 0) {
+        latency = presented - stats->input_read_ns;
+        ++stats->latency_samples;
+        stats->latency_total_ns += latency;
+        if (latency > stats->latency_max_ns) {
+            stats->latency_max_ns = latency;
+        }
+        stats->input_read_ns = 0;
+    } else if (stats->input_read_ns != 0 && presented - stats->input_read_ns > INPUT_LATENCY_TIMEOUT_NS) {
+        stats->input_read_ns = 0;
+    }
+
+    if (stats->log != NULL) {
+        fprintf(stats->log, "%" PRIu64 ",%.1f,%.1f,%.1f,", stats->frames, (emulated - start) / 1000.0, (rendered - emulated) / 1000.0, (presented - rendered) / 1000.0);
+        if (latency > 0) {
+            fprintf(stats->log, "%.1f", latency / 1000.0);
+        }
+        fprintf(stats->log, "\n");
+    }
+    return ;
+}
+
+void FrameStatsReport(FrameStats* stats) {
+    if (stats->log != NULL && fclose(stats->log) == EOF) {
+        perror("close frame log");
+    }
+    if (stats->frames == 0) {
+        return ;
+    }
+    fprintf(stderr, "frames: %" PRIu64 " (%" PRIu64 " late)\n", stats->frames, stats->late_frames);
+    fprintf(stderr, "avg us: emulate %.1f, render %.1f, present %.1f; max frame %.1f\n",
+            stats->emulate_ns / 1000.0 / stats->frames,
+            stats->render_ns / 1000.0 / stats->frames,
+            stats->present_ns / 1000.0 / stats->frames,
+            stats->max_frame_ns / 1000.0);
+    if (stats->latency_samples > 0) {
+        fprintf(stderr, "input latency ms: avg %.2f, max %.2f over %" PRIu64 " presses\n",
+                stats->latency_total_ns / 1e6 / stats->latency_samples,
+                stats->latency_max_ns / 1e6,
+                stats->latency_samples);
+    }
+    return ;
+}
+
+// Sleeps until the next frame deadline. Deadlines are absolute multiples of the frame period,
+// so oversleeping on one frame is paid back on the next instead of accumulating as drift.
+// After falling more than a whole frame behind, the schedule restarts from now rather than
+// running a burst of catch-up frames. Returns whether the deadline had already passed.
+bool WaitForNextFrame(uint64_t* deadline) {
+    *deadline += FRAME_PERIOD_NS;
+    uint64_t now = NowNs();
+    if (now > *deadline) {
+        if (now - *deadline > FRAME_PERIOD_NS) {
+            *deadline = now;
+        }
+        return true;
+    }
+    struct timespec ts = {
+        .tv_sec = *deadline / 1000000000,
+        .tv_nsec = *deadline % 1000000000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+    return false;
+}
+
+// With vsync on a display that is not 60 Hz, presenting paces the loop at the display's rate
+// instead. Returns how many emulated frames are due by now on the same absolute schedule as
+// WaitForNextFrame: none on some passes of a faster display, two on some of a slower one.
+// After falling more than a frame behind, the schedule restarts from now.
+unsigned long FramesDue(uint64_t* deadline) {
+    uint64_t now = NowNs();
+    if (now < *deadline) {
+        return 0;
+    }
+    unsigned long due = (now - *deadline) / FRAME_PERIOD_NS + 1;
+    if (due > 2) {
+        *deadline = now + FRAME_PERIOD_NS;
+        return 1;
+    }
+    *deadline += due * FRAME_PERIOD_NS;
+    return due;
+}
+
+// Runtime metrics. The frame loop is the only writer; the metrics file thread and the overlay
+// only read. Counters are relaxed atomics, so recording a frame costs a handful of plain loads
+// and stores and never takes a lock.
+
+#define METRICS_INTERVAL_NS 1000000000
+// Frame times are bucketed in 0.5ms steps; the last bucket also counts anything slower.
+#define FRAME_TIME_BUCKET_NS 500000
+#define FRAME_TIME_BUCKETS 100
+
+typedef struct {
+    atomic_uint_fast64_t instructions;
+    atomic_uint_fast64_t frames;
+    atomic_uint_fast64_t dropped_frames;
+    atomic_uint_fast64_t input_ns;
+    atomic_uint_fast64_t emulate_ns;
+    atomic_uint_fast64_t render_ns;
+    atomic_uint_fast64_t key_wait_ns;
+    atomic_uint_fast64_t frame_time_buckets[FRAME_TIME_BUCKETS];
+} Metrics;
+
+typedef struct {
+    uint64_t ns;
+    uint64_t instructions;
+    uint64_t frames;
+    uint64_t dropped_frames;
+    uint64_t input_ns;
+    uint64_t emulate_ns;
+    uint64_t render_ns;
+    uint64_t key_wait_ns;
+    uint64_t frame_time_buckets[FRAME_TIME_BUCKETS];
+} MetricsSample;
+
+// Rates and percentiles over the interval between two samples, plus running totals.
+typedef struct {
+    double ips;
+    double fps;
+    double frame_ms_p50;
+    double frame_ms_p90;
+    double frame_ms_p99;
+    double input_share;
+    double emulate_share;
+    double render_share;
+    double key_wait_share;
+    MetricsSample totals;
+} MetricsReport;
+
+Metrics metrics;
+
+// Only the frame loop writes, so a relaxed load and store is enough and avoids a locked add.
+void MetricsAdd(atomic_uint_fast64_t* counter, uint64_t val) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + val, memory_order_relaxed);
+    return ;
+}
+
+void MetricsRecordFrame(uint64_t instructions, uint64_t frame_ns, uint64_t input_ns, uint64_t emulate_ns, uint64_t render_ns, bool key_wait) {
+    MetricsAdd(&metrics.instructions, instructions);
+    MetricsAdd(&metrics.frames, 1);
+    MetricsAdd(&metrics.input_ns, input_ns);
+    MetricsAdd(&metrics.emulate_ns, emulate_ns);
+    MetricsAdd(&metrics.render_ns, render_ns);
+    if (key_wait) {
+        MetricsAdd(&metrics.key_wait_ns, frame_ns);
+    }
+    size_t bucket = frame_ns / FRAME_TIME_BUCKET_NS;
+    MetricsAdd(&metrics.frame_time_buckets[bucket < FRAME_TIME_BUCKETS ? bucket : FRAME_TIME_BUCKETS - 1], 1);
+    return ;
+}
+
+void MetricsTakeSample(MetricsSample* sample) {
+    sample->ns = NowNs();
+    sample->instructions = atomic_load_explicit(&metrics.instructions, memory_order_relaxed);
+    sample->frames = atomic_load_explicit(&metrics.frames, memory_order_relaxed);
+    sample->dropped_frames = atomic_load_explicit(&metrics.dropped_frames, memory_order_relaxed);
+    sample->input_ns = atomic_load_explicit(&metrics.input_ns, memory_order_relaxed);
+    sample->emulate_ns = atomic_load_explicit(&metrics.emulate_ns, memory_order_relaxed);
+    sample->render_ns = atomic_load_explicit(&metrics.render_ns, memory_order_relaxed);
+    sample->key_wait_ns = atomic_load_explicit(&metrics.key_wait_ns, memory_order_relaxed);
+    for (size_t i = 0; i < FRAME_TIME_BUCKETS; ++i) {
+        sample->frame_time_buckets[i] = atomic_load_explicit(&metrics.frame_time_buckets[i], memory_order_relaxed);
+    }
+    return ;
+}
+
+// Upper edge of the bucket holding the given quantile of the frames between the two samples.
+double FrameTimeQuantileMs(const MetricsSample* prev, const MetricsSample* cur, double quantile) {
+    uint64_t total = cur->frames - prev->frames;
+    if (total == 0) {
+        return 0.0;
+    }
+    uint64_t rank = (uint64_t)(quantile * total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < FRAME_TIME_BUCKETS; ++i) {
+        seen += cur->frame_time_buckets[i] - prev->frame_time_buckets[i];
+        if (seen > rank) {
+            return (i + 1) * FRAME_TIME_BUCKET_NS / 1e6;
+        }
+    }
+    return FRAME_TIME_BUCKETS * FRAME_TIME_BUCKET_NS / 1e6;
+}
+
+void MetricsCompute(const MetricsSample* prev, const MetricsSample* cur, MetricsReport* report) {
+    double elapsed_ns = cur->ns > prev->ns ? (double)(cur->ns - prev->ns) : 1.0;
+    report->ips = (cur->instructions - prev->instructions) * 1e9 / elapsed_ns;
+    report->fps = (cur->frames - prev->frames) * 1e9 / elapsed_ns;
+    report->frame_ms_p50 = FrameTimeQuantileMs(prev, cur, 0.50);
+    report->frame_ms_p90 = FrameTimeQuantileMs(prev, cur, 0.90);
+    report->frame_ms_p99 = FrameTimeQuantileMs(prev, cur, 0.99);
+    report->input_share = (cur->input_ns - prev->input_ns) / elapsed_ns;
+    report->emulate_share = (cur->emulate_ns - prev->emulate_ns) / elapsed_ns;
+    report->render_share = (cur->render_ns - prev->render_ns) / elapsed_ns;
+    report->key_wait_share = (cur->key_wait_ns - prev->key_wait_ns) / elapsed_ns;
+    report->totals = *cur;
+    return ;
+}
+
+void WriteMetricsJSON(FILE* file, const MetricsReport* report) {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"instructions_total\": %" PRIu64 ",\n", report->totals.instructions);
+    fprintf(file, "  \"frames_total\": %" PRIu64 ",\n", report->totals.frames);
+    fprintf(file, "  \"dropped_frames_total\": %" PRIu64 ",\n", report->totals.dropped_frames);
+    fprintf(file, "  \"instructions_per_second\": %.1f,\n", report->ips);
+    fprintf(file, "  \"frames_per_second\": %.2f,\n", report->fps);
+    fprintf(file, "  \"frame_time_ms\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f},\n", report->frame_ms_p50, report->frame_ms_p90, report->frame_ms_p99);
+    fprintf(file, "  \"seconds_total\": {\"input\": %.6f, \"emulate\": %.6f, \"render\": %.6f, \"key_wait\": %.6f}\n",
+            report->totals.input_ns / 1e9, report->totals.emulate_ns / 1e9, report->totals.render_ns / 1e9, report->totals.key_wait_ns / 1e9);
+    fprintf(file, "}\n");
+    return ;
+}
+
+void WriteMetricsPrometheus(FILE* file, const MetricsReport* report) {
+    fprintf(file, "# TYPE chip8_instructions_total counter\nchip8_instructions_total %" PRIu64 "\n", report->totals.instructions);
+    fprintf(file, "# TYPE chip8_frames_total counter\nchip8_frames_total %" PRIu64 "\n", report->totals.frames);
+    fprintf(file, "# TYPE chip8_dropped_frames_total counter\nchip8_dropped_frames_total %" PRIu64 "\n", report->totals.dropped_frames);
+    fprintf(file, "# TYPE chip8_instructions_per_second gauge\nchip8_instructions_per_second %.1f\n", report->ips);
+    fprintf(file, "# TYPE chip8_frames_per_second gauge\nchip8_frames_per_second %.2f\n", report->fps);
+    fprintf(file, "# TYPE chip8_frame_time_seconds summary\n");
+    fprintf(file, "chip8_frame_time_seconds{quantile=\"0.5\"} %.4f\n", report->frame_ms_p50 / 1e3);
+    fprintf(file, "chip8_frame_time_seconds{quantile=\"0.9\"} %.4f\n", report->frame_ms_p90 / 1e3);
+    fprintf(file, "chip8_frame_time_seconds{quantile=\"0.99\"} %.4f\n", report->frame_ms_p99 / 1e3);
+    fprintf(file, "# TYPE chip8_seconds_total counter\n");
+    fprintf(file, "chip8_seconds_total{stage=\"input\"} %.6f\n", report->totals.input_ns / 1e9);
+    fprintf(file, "chip8_seconds_total{stage=\"emulate\"} %.6f\n", report->totals.emulate_ns / 1e9);
+    fprintf(file, "chip8_seconds_total{stage=\"render\"} %.6f\n", report->totals.render_ns / 1e9);
+    fprintf(file, "chip8_seconds_total{stage=\"key_wait\"} %.6f\n", report->totals.key_wait_ns / 1e9);
+    return ;
+}
+
+// Writes the report to path through a temporary file and rename, so readers never see a
+// partial file. Paths ending in ".json" get JSON, anything else Prometheus text format.
+void WriteMetrics(const char* path, const MetricsReport* report) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        perror(tmp_path);
+        return ;
+    }
+    size_t len = strlen(path);
+    if (len >= 5 && strcmp(&path[len - 5], ".json") == 0) {
+        WriteMetricsJSON(file, report);
+    } else {
+        WriteMetricsPrometheus(file, report);
+    }
+    if (fclose(file) == EOF || rename(tmp_path, path) == -1) {
+        perror(path);
+    }
+    return ;
+}
+
+typedef struct {
+    const char* path;
+    bool stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+} MetricsWriter;
+
+void* MetricsWriterLoop(void* arg) {
+    MetricsWriter* writer = (MetricsWriter*)arg;
+    MetricsSample prev;
+    MetricsSample cur;
+    MetricsReport report;
+    MetricsTakeSample(&prev);
+    pthread_mutex_lock(&writer->lock);
+    while (!writer->stopping) {
+        uint64_t wake = NowNs() + METRICS_INTERVAL_NS;
+        struct timespec ts = {
+            .tv_sec = wake / 1000000000,
+            .tv_nsec = wake % 1000000000,
+        };
+        pthread_cond_timedwait(&writer->stop, &writer->lock, &ts);
+        MetricsTakeSample(&cur);
+        MetricsCompute(&prev, &cur, &report);
+        WriteMetrics(writer->path, &report);
+        prev = cur;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+void MetricsWriterInit(MetricsWriter* writer, const char* path) {
+    memset(writer, 0, sizeof(MetricsWriter));
+    writer->path = path;
+    pthread_mutex_init(&writer->lock, NULL);
+    // Timed waits are measured against CLOCK_MONOTONIC, the same clock as NowNs.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&writer->stop, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&writer->thread, NULL, MetricsWriterLoop, writer) != 0) {
+        fprintf(stderr, "Failed to start metrics writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+    return ;
+}
+
+// Writes one last report and stops the writer thread.
+void MetricsWriterClose(MetricsWriter* writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_signal(&writer->stop);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->stop);
+    return ;
+}
+
+// On-screen overlay, drawn in a 3x5 pixel font at four times the CHIP-8 resolution.
+#define OVERLAY_SCALE 4
+#define GLYPH_WIDTH 3
+#define GLYPH_HEIGHT 5
+
+const char glyph_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.:%/-";
+const uint8_t glyphs[][GLYPH_HEIGHT] = {
+    {7, 5, 5, 5, 7}, {2, 6, 2, 2, 7}, {7, 1, 7, 4, 7}, {7, 1, 7, 1, 7}, {5, 5, 7, 1, 1},
+    {7, 4, 7, 1, 7}, {7, 4, 7, 5, 7}, {7, 1, 2, 2, 2}, {7, 5, 7, 5, 7}, {7, 5, 7, 1, 7},
+    {2, 5, 7, 5, 5}, {6, 5, 6, 5, 6}, {3, 4, 4, 4, 3}, {6, 5, 5, 5, 6}, {7, 4, 6, 4, 7},
+    {7, 4, 6, 4, 4}, {3, 4, 5, 5, 3}, {5, 5, 7, 5, 5}, {7, 2, 2, 2, 7}, {1, 1, 1, 5, 2},
+    {5, 5, 6, 5, 5}, {4, 4, 4, 4, 7}, {5, 7, 7, 5, 5}, {6, 5, 5, 5, 5}, {2, 5, 5, 5, 2},
+    {6, 5, 6, 4, 4}, {2, 5, 5, 6, 3}, {6, 5, 6, 5, 5}, {3, 4, 2, 1, 6}, {7, 2, 2, 2, 2},
+    {5, 5, 5, 5, 7}, {5, 5, 5, 5, 2}, {5, 5, 7, 7, 5}, {5, 5, 2, 5, 5}, {5, 5, 2, 2, 2},
+    {7, 1, 2, 4, 7}, {0, 0, 0, 0, 2}, {0, 2, 0, 2, 0}, {5, 1, 2, 4, 5}, {1, 1, 2, 4, 4},
+    {0, 0, 7, 0, 0},
+};
+
+bool overlay_enabled = false;
+
+void DrawText(int x, int y, const char* text) {
+    for (; *text != '\0'; ++text, x += GLYPH_WIDTH + 1) {
+        const char* found = strchr(glyph_chars, *text);
+        if (*text == ' ' || found == NULL) {
+            continue;
+        }
+        const uint8_t* glyph = glyphs[found - glyph_chars];
+        for (int row = 0; row < GLYPH_HEIGHT; ++row) {
+            for (int col = 0; col < GLYPH_WIDTH; ++col) {
+                if ((glyph[row] >> (GLYPH_WIDTH - 1 - col)) & 0x01) {
+                    SDL_RenderDrawPoint(renderer, x + col, y + row);
+                }
+            }
+        }
+    }
+    return ;
+}
+
+void DrawOverlay(const MetricsReport* report) {
+    char lines[5][64];
+    snprintf(lines[0], sizeof(lines[0]), "IPS %.0f FPS %.1f", report->ips, report->fps);
+    snprintf(lines[1], sizeof(lines[1]), "FT P50 %.1f P90 %.1f P99 %.1f", report->frame_ms_p50, report->frame_ms_p90, report->frame_ms_p99);
+    snprintf(lines[2], sizeof(lines[2]), "DROPPED %" PRIu64, report->totals.dropped_frames);
+    snprintf(lines[3], sizeof(lines[3]), "INP %.1f%% EMU %.1f%% RND %.1f%%", report->input_share * 100, report->emulate_share * 100, report->render_share * 100);
+    snprintf(lines[4], sizeof(lines[4]), "KEY WAIT %.0f%%", report->key_wait_share * 100);
+
+    SDL_RenderSetLogicalSize(renderer, RESOLUTION_WIDTH * OVERLAY_SCALE, RESOLUTION_HEIGHT * OVERLAY_SCALE);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 192);
+    SDL_Rect background = {0, 0, RESOLUTION_WIDTH * OVERLAY_SCALE, 5 * (GLYPH_HEIGHT + 1) + 1};
+    SDL_RenderFillRect(renderer, &background);
+    SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+    for (int i = 0; i < 5; ++i) {
+        DrawText(1, 1 + i * (GLYPH_HEIGHT + 1), lines[i]);
+    }
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    SDL_RenderSetLogicalSize(renderer, RESOLUTION_WIDTH, RESOLUTION_HEIGHT);
+    return ;
+}
+
+// Run configuration. Settings come from profile files and the command line, applied in the
+// order given so later ones win, and are resolved once into a Config before anything starts.
+// A profile file holds one "option = value" per line, using the long option names (a switch
+// may be given alone or with true/false), with # comments:
+//   cpu-hz = 1000
+//   quirks = vip
+//   vsync
+#define DEFAULT_DECAY 96
+#define DEFAULT_SCALE 10
+#define DEFAULT_TURBO_RATIO 10
+#define MAX_PROFILE_DEPTH 8
+#define DEFAULT_INPUT_DELAY 2
+#define MAX_INPUT_DELAY 16
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+typedef enum {
+    TRACE_NONE,
+    // One line per frame.
+    TRACE_FRAMES,
+    // One line per instruction, before it executes.
+    TRACE_INSTRUCTIONS,
+} TraceLevel;
+
+typedef struct {
+    const char* rom_path;
+    bool headless;
+    RenderMode render_mode;
+    uint8_t decay;
+    bool fullscreen;
+    bool vsync;
+    unsigned long scale;
+    uint32_t cycles_per_frame;
+    uint8_t quirks;
+    uint32_t seed;
+    // 0 for no limit. A run stops at the end of the frame that reaches either.
+    unsigned long frame_limit;
+    uint64_t cycle_limit;
+    TraceLevel trace;
+    bool turbo;
+    // Emulated frames per presented frame, or 0 for as many as fit.
+    unsigned long turbo_ratio;
+    bool debug;
+    uint16_t debug_port;
+    const char* keymap_path;
+    const char* timing_path;
+    const char* metrics_path;
+    const char* snapshot_path;
+    const char* video_path;
+    // Whether a windowed run's video stream waits for its reader rather than dropping frames.
+    // Headless runs have no deadline to keep, so theirs always waits.
+    bool video_lossless;
+    const char* record_path;
+    const char* replay_path;
+    const char* load_state_path;
+    const char* save_state_path;
+    // POSIX shared memory object for the event ring.
+    const char* events_name;
+    // Netplay listens on netplay_port, or connects to netplay_peer ("host:port").
+    bool netplay;
+    uint16_t netplay_port;
+    const char* netplay_peer;
+    uint32_t input_delay;
+    // Shown in the window title; the ROM's title when it comes from a library.
+    const char* title;
+    // From a library entry: the ROM image, and keymap text used when there is no keymap file.
+    const uint8_t* rom_data;
+    size_t rom_size;
+    const char* keymap_text;
+    const char* library_path;
+    // --build-library writes an index of library_roms and exits; --list-library lists one.
+    const char* build_library_path;
+    bool list_library;
+    char** library_roms;
+    int library_rom_count;
+} Config;
+
+// Ids of options without a short form.
+typedef enum {
+    OPT_SCALE = 256,
+    OPT_CPU_HZ,
+    OPT_QUIRKS,
+    OPT_SEED,
+    OPT_CYCLES,
+    OPT_TRACE,
+    OPT_RECORD,
+    OPT_REPLAY,
+    OPT_LOAD_STATE,
+    OPT_SAVE_STATE,
+    OPT_NETPLAY_LISTEN,
+    OPT_NETPLAY_CONNECT,
+    OPT_INPUT_DELAY,
+    OPT_LIBRARY,
+    OPT_BUILD_LIBRARY,
+    OPT_LIST_LIBRARY,
+    OPT_EVENTS,
+    OPT_VIDEO_LOSSLESS,
+} LongOption;
+
+typedef struct {
+    const char* name;
+    // The short option character, or a LongOption.
+    int id;
+    // Name of the value, or NULL for a switch.
+    const char* arg;
+    const char* help;
+} ConfigOption;
+
+const ConfigOption config_options[] = {
+    {"help", 'h', NULL, "show this help"},
+    {"profile", 'P', "file", "apply the settings in a profile file"},
+    {"headless", 'H', NULL, "no window, no input, no throttling"},
+    {"gpu", 'g', NULL, "GPU streaming renderer with phosphor persistence"},
+    {"decay", 'p', "1-255", "glow removed per frame with --gpu (default " TO_STRING(DEFAULT_DECAY) ", 255 = no persistence)"},
+    {"fullscreen", 'F', NULL, "integer-scaled fullscreen"},
+    {"vsync", 'V', NULL, "pace frames by display vsync instead of the monotonic clock"},
+    {"scale", OPT_SCALE, "n", "window size in screen pixels per CHIP-8 pixel (default " TO_STRING(DEFAULT_SCALE) ")"},
+    {"cpu-hz", OPT_CPU_HZ, "hz", "instructions per second, rounded to a whole number per frame (default 840)"},
+    {"quirks", OPT_QUIRKS, "set", "default, vip, schip, or a list of shift,load-store,jump,vf-reset,clip"},
+    {"seed", OPT_SEED, "n", "seed for CXKK's random numbers (default 0)"},
+    {"frames", 'n', "n", "stop after this many frames"},
+    {"cycles", OPT_CYCLES, "n", "stop after the frame in which this many instructions have run"},
+    {"trace", OPT_TRACE, "level", "trace to stderr: none, frames or instructions"},
+    {"turbo", 'T', "ratio|max", "start in turbo mode, running this many frames per presented one (default " TO_STRING(DEFAULT_TURBO_RATIO) ")"},
+    {"keymap", 'k', "file", "keymap file, reloaded on F5 or SIGHUP"},
+    {"debug", 'd', NULL, "start in the debugger, on stdin/stdout"},
+    {"debug-port", 'D', "port", "start in the debugger, on the first connection to this localhost port"},
+    {"timing", 't', "file.csv", "write per-frame timing and input latency"},
+    {"metrics", 'm', "file", "write runtime metrics every second, as JSON for .json, else Prometheus text"},
+    {"snapshot", 's', "file", "frame snapshot (.png or .ppm), written on F12/SIGUSR1 and at exit"},
+    {"video", 'v', "file", "stream raw 1-bit 64x32 frames to this file, pipe or - for stdout"},
+    {"video-lossless", OPT_VIDEO_LOSSLESS, NULL, "make --video in a window wait for the reader instead of dropping frames (always on when headless)"},
+    {"record", OPT_RECORD, "file", "record the keys held in every frame"},
+    {"replay", OPT_REPLAY, "file", "play recorded keys instead of reading input, stopping at the end"},
+    {"load-state", OPT_LOAD_STATE, "file", "start from a saved state; F3 loads it again"},
+    {"save-state", OPT_SAVE_STATE, "file", "save the state here on F2 and at exit"},
+    {"netplay-listen", OPT_NETPLAY_LISTEN, "port", "host a two-player netplay session on this UDP port"},
+    {"netplay-connect", OPT_NETPLAY_CONNECT, "host:port", "join a netplay session"},
+    {"library", OPT_LIBRARY, "index", "look the ROM up in a library index, by file, SHA-1 prefix or title, and use its settings"},
+    {"build-library", OPT_BUILD_LIBRARY, "index", "write a library index of the ROMs given and exit"},
+    {"list-library", OPT_LIST_LIBRARY, NULL, "list the ROMs in the --library index and exit"},
+    {"events", OPT_EVENTS, "/name", "publish sprite draws and ram changes in a shared memory ring"},
+    {"input-delay", OPT_INPUT_DELAY, "frames", "netplay frames between reading keys and using them (default " TO_STRING(DEFAULT_INPUT_DELAY) ", max " TO_STRING(MAX_INPUT_DELAY) ")"},
+};
+
+#define NUM_CONFIG_OPTIONS (sizeof(config_options) / sizeof(config_options[0]))
+
+void Usage() {
+    fprintf(stderr, "usage: main [options] <rom-filename>\n");
+    for (size_t i = 0; i < NUM_CONFIG_OPTIONS; ++i) {
+        const ConfigOption* option = &config_options[i];
+        char flag[4] = "";
+        if (option->id < OPT_SCALE) {
+            snprintf(flag, sizeof(flag), "-%c,", option->id);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "--%s%s%s", option->name, option->arg != NULL ? "=" : "", option->arg != NULL ? option->arg : "");
+        fprintf(stderr, "  %-3s %-22s %s\n", flag, name, option->help);
+    }
+    fflush(stderr);
+    return ;
+}
+
+const ConfigOption* FindOption(int id, const char* name) {
+    for (size_t i = 0; i < NUM_CONFIG_OPTIONS; ++i) {
+        if (name != NULL ? strcmp(config_options[i].name, name) == 0 : config_options[i].id == id) {
+            return &config_options[i];
+        }
+    }
+    return NULL;
+}
+
+bool ParseNumber(const char* str, unsigned long long max, unsigned long long* val) {
+    char* end = NULL;
+    errno = 0;
+    *val = strtoull(str, &end, 0);
+    return *str != '\0' && *str != '-' && *end == '\0' && errno == 0 && *val <= max;
+}
+
+bool ParseSwitch(const char* str, bool* val) {
+    if (str == NULL || strcmp(str, "true") == 0 || strcmp(str, "yes") == 0 || strcmp(str, "1") == 0) {
+        *val = true;
+        return true;
+    }
+    if (strcmp(str, "false") == 0 || strcmp(str, "no") == 0 || strcmp(str, "0") == 0) {
+        *val = false;
+        return true;
+    }
+    return false;
+}
+
+bool ParseQuirks(const char* str, uint8_t* quirks) {
+    if (strcmp(str, "default") == 0) {
+        *quirks = QUIRKS_DEFAULT;
+        return true;
+    }
+    if (strcmp(str, "vip") == 0) {
+        *quirks = QUIRKS_VIP;
+        return true;
+    }
+    if (strcmp(str, "schip") == 0) {
+        *quirks = QUIRKS_SCHIP;
+        return true;
+    }
+    const char* names[] = {"shift", "load-store", "jump", "vf-reset", "clip"};
+    uint8_t parsed = 0;
+    while (*str != '\0') {
+        size_t len = strcspn(str, ",");
+        size_t i = 0;
+        while (i < sizeof(names) / sizeof(names[0]) && (strlen(names[i]) != len || strncmp(names[i], str, len) != 0)) {
+            ++i;
+        }
+        if (i == sizeof(names) / sizeof(names[0])) {
+            return false;
+        }
+        parsed |= 1 << i;
+        str += str[len] == ',' ? len + 1 : len;
+    }
+    *quirks = parsed;
+    return true;
+}
+
+bool ParseTrace(const char* str, TraceLevel* trace) {
+    const char* names[] = {"none", "frames", "instructions"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strcmp(names[i], str) == 0) {
+            *trace = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Instructions per 60 Hz frame closest to a clock rate, at least one.
+uint32_t CyclesPerFrame(unsigned long long hz) {
+    uint32_t cycles = (hz + FRAME_RATE / 2) / FRAME_RATE;
+    return cycles > 0 ? cycles : 1;
+}
+
+void LoadProfile(Config* config, const char* path, int depth);
+
+// Applies one setting; value is NULL for a switch given on its own. Exits on a bad value.
+void ApplyOption(Config* config, int id, const char* value, const char* source, int depth) {
+    unsigned long long num = 0;
+    bool on = false;
+    bool ok = true;
+    switch (id) {
+        case 'h': {
+            Usage();
+            exit(EXIT_SUCCESS);
+        }
+        case 'P': {
+            LoadProfile(config, value, depth + 1);
+            break;
+        }
+        case 'H': {
+            ok = ParseSwitch(value, &config->headless);
+            break;
+        }
+        case 'g': {
+            ok = ParseSwitch(value, &on);
+            config->render_mode = on ? RENDER_STREAMING : RENDER_LEGACY;
+            break;
+        }
+        case 'p': {
+            ok = ParseNumber(value, 255, &num) && num >= 1;
+            config->decay = num;
+            break;
+        }
+        case 'F': {
+            ok = ParseSwitch(value, &config->fullscreen);
+            break;
+        }
+        case 'V': {
+            ok = ParseSwitch(value, &config->vsync);
+            break;
+        }
+        case OPT_SCALE: {
+            ok = ParseNumber(value, 64, &num) && num >= 1;
+            config->scale = num;
+            break;
+        }
+        case OPT_CPU_HZ: {
+            ok = ParseNumber(value, 1000000000, &num) && num >= 1;
+            config->cycles_per_frame = CyclesPerFrame(num);
+            break;
+        }
+        case OPT_QUIRKS: {
+            ok = ParseQuirks(value, &config->quirks);
+            break;
+        }
+        case OPT_SEED: {
+            ok = ParseNumber(value, UINT32_MAX, &num);
+            config->seed = num;
+            break;
+        }
+        case 'n': {
+            ok = ParseNumber(value, ULONG_MAX, &num);
+            config->frame_limit = num;
+            break;
+        }
+        case OPT_CYCLES: {
+            ok = ParseNumber(value, UINT64_MAX, &num);
+            config->cycle_limit = num;
+            break;
+        }
+        case OPT_TRACE: {
+            ok = ParseTrace(value, &config->trace);
+            break;
+        }
+        case 'T': {
+            config->turbo = true;
+            ok = strcmp(value, "max") == 0 || (ParseNumber(value, ULONG_MAX, &num) && num >= 1);
+            config->turbo_ratio = num;
+            break;
+        }
+        case 'k': {
+            config->keymap_path = value;
+            break;
+        }
+        case 'd': {
+            ok = ParseSwitch(value, &config->debug);
+            break;
+        }
+        case 'D': {
+            config->debug = true;
+            ok = ParseNumber(value, UINT16_MAX, &num) && num >= 1;
+            config->debug_port = num;
+            break;
+        }
+        case 't': {
+            config->timing_path = value;
+            break;
+        }
+        case 'm': {
+            config->metrics_path = value;
+            break;
+        }
+        case 's': {
+            config->snapshot_path = value;
+            break;
+        }
+        case 'v': {
+            config->video_path = value;
+            break;
+        }
+        case OPT_RECORD: {
+            config->record_path = value;
+            break;
+        }
+        case OPT_REPLAY: {
+            config->replay_path = value;
+            break;
+        }
+        case OPT_LOAD_STATE: {
+            config->load_state_path = value;
+            break;
+        }
+        case OPT_SAVE_STATE: {
+            config->save_state_path = value;
+            break;
+        }
+        case OPT_NETPLAY_LISTEN: {
+            ok = ParseNumber(value, UINT16_MAX, &num) && num >= 1;
+            config->netplay = true;
+            config->netplay_port = num;
+            config->netplay_peer = NULL;
+            break;
+        }
+        case OPT_NETPLAY_CONNECT: {
+            ok = strchr(value, ':') != NULL;
+            config->netplay = true;
+            config->netplay_peer = value;
+            break;
+        }
+        case OPT_LIBRARY: {
+            config->library_path = value;
             break;
         }
-        case SDLK_s: {
-            key = KEY_8;
-            break;
+        case OPT_BUILD_LIBRARY: {
+            config->build_library_path = value;
+            break;
+        }
+        case OPT_LIST_LIBRARY: {
+            ok = ParseSwitch(value, &config->list_library);
+            break;
+        }
+        case OPT_VIDEO_LOSSLESS: {
+            ok = ParseSwitch(value, &config->video_lossless);
+            break;
+        }
+        case OPT_EVENTS: {
+            ok = value[0] == '/' && strchr(value + 1, '/') == NULL;
+            config->events_name = value;
+            break;
+        }
+        case OPT_INPUT_DELAY: {
+            ok = ParseNumber(value, MAX_INPUT_DELAY, &num);
+            config->input_delay = num;
+            break;
+        }
+        default: {
+            Usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: invalid value for --%s: %s\n", source, FindOption(id, NULL)->name, value != NULL ? value : "");
+        exit(EXIT_FAILURE);
+    }
+    return ;
+}
+
+void LoadProfile(Config* config, const char* path, int depth) {
+    if (depth > MAX_PROFILE_DEPTH) {
+        fprintf(stderr, "%s: profiles nested too deeply\n", path);
+        exit(EXIT_FAILURE);
+    }
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    char buf[1024];
+    for (size_t line = 1; fgets(buf, sizeof(buf), file) != NULL; ++line) {
+        char* comment = strchr(buf, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char* value = strchr(buf, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+            // Settings outlive the line buffer.
+            value = strdup(TrimSpace(value));
+        }
+        char* name = TrimSpace(buf);
+        if (*name == '\0') {
+            continue;
+        }
+        char source[512];
+        snprintf(source, sizeof(source), "%s:%zu", path, line);
+        const ConfigOption* option = FindOption(0, name);
+        if (option == NULL || (option->arg != NULL && value == NULL)) {
+            fprintf(stderr, "%s: %s option \"%s\"\n", source, option == NULL ? "unknown" : "missing value for", name);
+            exit(EXIT_FAILURE);
+        }
+        ApplyOption(config, option->id, value, source, depth);
+    }
+    fclose(file);
+    return ;
+}
+
+// ROM library. An index file holds every ROM's image and metadata, keyed by the SHA-1 of the
+// image, so listing or launching from thousands of ROMs costs one mmap instead of a file open
+// per ROM. Metadata comes from an optional "<rom>.cfg" beside each ROM when the index is built:
+//   title = Space Invaders
+//   quirks = schip
+//   cpu-hz = 1000
+//   keymap = invaders.keymap
+// Anything left out is derived: the title from the file name and the quirks from whether the
+// ROM uses SUPER-CHIP instructions. The core runs straight from ram, so the stored image is
+// what LoadProgram copies, with nothing further to decode.
+//
+// Layout, little-endian, offsets from the start of the file: a LibraryHeader, count
+// LibraryEntry records sorted by sha1, then strings and images.
+#define LIBRARY_MAGIC "C8LB"
+#define LIBRARY_VERSION 1
+#define SHA1_SIZE 20
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t entries;
+} __attribute__((packed)) LibraryHeader;
+
+typedef struct {
+    uint8_t sha1[SHA1_SIZE];
+    // NUL-terminated strings; keymap is 0 for the default bindings.
+    uint32_t title;
+    uint32_t keymap;
+    uint32_t image;
+    uint32_t image_size;
+    uint32_t cpu_hz;
+    uint8_t quirks;
+    uint8_t reserved[3];
+} __attribute__((packed)) LibraryEntry;
+
+typedef struct {
+    const uint8_t* base;
+    size_t size;
+    uint32_t count;
+    const LibraryEntry* entries;
+} Library;
+
+Library library;
+
+typedef struct {
+    uint32_t h[5];
+    uint64_t length;
+    uint8_t block[64];
+    size_t used;
+} Sha1;
+
+uint32_t Rotl32(uint32_t x, int n) {
+    return x << n | x >> (32 - n);
+}
+
+void Sha1Block(Sha1* sha, const uint8_t* block) {
+    uint32_t w[80];
+    for (int t = 0; t < 16; ++t) {
+        w[t] = (uint32_t)block[4 * t] << 24 | block[4 * t + 1] << 16 | block[4 * t + 2] << 8 | block[4 * t + 3];
+    }
+    for (int t = 16; t < 80; ++t) {
+        w[t] = Rotl32(w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16], 1);
+    }
+    uint32_t a = sha->h[0], b = sha->h[1], c = sha->h[2], d = sha->h[3], e = sha->h[4];
+    for (int t = 0; t < 80; ++t) {
+        uint32_t f, k;
+        if (t < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (t < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (t < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t temp = Rotl32(a, 5) + f + e + k + w[t];
+        e = d;
+        d = c;
+        c = Rotl32(b, 30);
+        b = a;
+        a = temp;
+    }
+    sha->h[0] += a;
+    sha->h[1] += b;
+    sha->h[2] += c;
+    sha->h[3] += d;
+    sha->h[4] += e;
+    return ;
+}
+
+void Sha1Digest(const uint8_t* data, size_t size, uint8_t digest[SHA1_SIZE]) {
+    Sha1 sha = {{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0}, 0, {0}, 0};
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        Sha1Block(&sha, &data[i]);
+    }
+    // Pad with 0x80, zeros and the length in bits, spilling into a second block if needed.
+    uint8_t tail[128] = {0};
+    size_t rest = size - i;
+    memcpy(tail, &data[i], rest);
+    tail[rest] = 0x80;
+    size_t tail_size = rest + 9 <= 64 ? 64 : 128;
+    uint64_t bits = (uint64_t)size * 8;
+    for (int k = 0; k < 8; ++k) {
+        tail[tail_size - 1 - k] = bits >> (8 * k);
+    }
+    for (size_t k = 0; k < tail_size; k += 64) {
+        Sha1Block(&sha, &tail[k]);
+    }
+    for (int k = 0; k < 5; ++k) {
+        digest[4 * k] = sha.h[k] >> 24;
+        digest[4 * k + 1] = sha.h[k] >> 16;
+        digest[4 * k + 2] = sha.h[k] >> 8;
+        digest[4 * k + 3] = sha.h[k];
+    }
+    return ;
+}
+
+void FormatSha1(const uint8_t sha1[SHA1_SIZE], char hex[2 * SHA1_SIZE + 1]) {
+    for (int k = 0; k < SHA1_SIZE; ++k) {
+        snprintf(&hex[2 * k], 3, "%02x", sha1[k]);
+    }
+    return ;
+}
+
+// A string from the index, or NULL if offset does not name one inside the file.
+const char* LibraryString(const Library* lib, uint32_t offset) {
+    if (offset == 0 || offset >= lib->size || memchr(&lib->base[offset], '\0', lib->size - offset) == NULL) {
+        return NULL;
+    }
+    return (const char*)&lib->base[offset];
+}
+
+// Maps an index file and checks that every entry points inside it. Exits if it is not a
+// library index.
+void LibraryOpen(Library* lib, const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    lib->size = st.st_size;
+    lib->base = lib->size > 0 ? mmap(NULL, lib->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    const LibraryHeader* header = (const LibraryHeader*)lib->base;
+    if (lib->base == MAP_FAILED || lib->size < sizeof(LibraryHeader) || memcmp(header->magic, LIBRARY_MAGIC, 4) != 0
+        || le32toh(header->version) != LIBRARY_VERSION) {
+        fprintf(stderr, "%s: not a ROM library index\n", path);
+        exit(EXIT_FAILURE);
+    }
+    lib->count = le32toh(header->count);
+    uint64_t entries = le32toh(header->entries);
+    if (entries + (uint64_t)lib->count * sizeof(LibraryEntry) > lib->size) {
+        fprintf(stderr, "%s: truncated ROM library index\n", path);
+        exit(EXIT_FAILURE);
+    }
+    lib->entries = (const LibraryEntry*)&lib->base[entries];
+    for (uint32_t i = 0; i < lib->count; ++i) {
+        const LibraryEntry* entry = &lib->entries[i];
+        if (LibraryString(lib, le32toh(entry->title)) == NULL || (entry->keymap != 0 && LibraryString(lib, le32toh(entry->keymap)) == NULL)
+            || (uint64_t)le32toh(entry->image) + le32toh(entry->image_size) > lib->size || le32toh(entry->image_size) > NUM_RAM - PROGRAM_START) {
+            fprintf(stderr, "%s: corrupt entry %" PRIu32 "\n", path, i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return ;
+}
+
+int CompareSha1(const void* key, const void* entry) {
+    return memcmp(key, ((const LibraryEntry*)entry)->sha1, SHA1_SIZE);
+}
+
+// Finds a ROM by file (hashed), by a prefix of its SHA-1 in hex, or by title.
+const LibraryEntry* LibraryFind(const Library* lib, const char* name) {
+    if (access(name, R_OK) == 0) {
+        Rom rom;
+        RomInit(&rom, name);
+        uint8_t sha1[SHA1_SIZE];
+        Sha1Digest(rom.data, rom.size, sha1);
+        free(rom.data);
+        return bsearch(sha1, lib->entries, lib->count, sizeof(LibraryEntry), CompareSha1);
+    }
+    size_t len = strlen(name);
+    bool hex = len >= 6 && len <= 2 * SHA1_SIZE && strspn(name, "0123456789abcdefABCDEF") == len;
+    for (uint32_t i = 0; i < lib->count; ++i) {
+        const LibraryEntry* entry = &lib->entries[i];
+        char digest[2 * SHA1_SIZE + 1];
+        FormatSha1(entry->sha1, digest);
+        if (hex ? strncasecmp(digest, name, len) == 0 : strcasecmp(LibraryString(lib, le32toh(entry->title)), name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Prints one line per ROM: hash, quirk bits, CPU Hz, size and title.
+void LibraryList(const Library* lib) {
+    for (uint32_t i = 0; i < lib->count; ++i) {
+        const LibraryEntry* entry = &lib->entries[i];
+        char digest[2 * SHA1_SIZE + 1];
+        FormatSha1(entry->sha1, digest);
+        printf("%s  %02x  %5" PRIu32 " Hz  %4" PRIu32 " bytes  %s\n", digest, entry->quirks, le32toh(entry->cpu_hz),
+               le32toh(entry->image_size), LibraryString(lib, le32toh(entry->title)));
+    }
+    return ;
+}
+
+// Whether the ROM uses any SUPER-CHIP instruction: scroll, exit, resolution switch, large font
+// or flag registers. Those games also expect SUPER-CHIP's quirks. Only instructions reachable
+// from the entry point count, since sprite data is full of byte pairs that look like them;
+// the walk follows jumps, calls and both sides of skips, and gives up at BNNN.
+bool UsesSuperChip(const uint8_t* data, size_t size) {
+    bool seen[NUM_RAM] = {false};
+    uint16_t pending[3 * NUM_RAM];
+    size_t npending = 0;
+    pending[npending++] = PROGRAM_START;
+    while (npending > 0) {
+        uint16_t addr = pending[--npending];
+        if (addr < PROGRAM_START || (size_t)addr + 1 >= PROGRAM_START + size || seen[addr]) {
+            continue;
+        }
+        seen[addr] = true;
+        uint16_t instruction = data[addr - PROGRAM_START] << 8 | data[addr - PROGRAM_START + 1];
+        if ((instruction & 0xFFF0) == 0x00C0 || (instruction >= 0x00FB && instruction <= 0x00FF)
+            || (instruction & 0xF0FF) == 0xF030 || (instruction & 0xF0FF) == 0xF075 || (instruction & 0xF0FF) == 0xF085) {
+            return true;
+        }
+        uint16_t opcode = instruction & 0xF000;
+        uint16_t skip = instruction & 0xF0FF;
+        if (opcode == 0x1000 || opcode == 0x2000) {
+            pending[npending++] = instruction & 0x0FFF;
+        }
+        if (opcode == 0x3000 || opcode == 0x4000 || opcode == 0x5000 || opcode == 0x9000 || skip == 0xE09E || skip == 0xE0A1) {
+            pending[npending++] = addr + 4;
+        }
+        if (opcode != 0x1000 && opcode != 0xB000 && instruction != 0x00EE) {
+            pending[npending++] = addr + 2;
+        }
+    }
+    return false;
+}
+
+// Growable byte buffer the index is assembled in.
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} Buffer;
+
+uint32_t BufferAppend(Buffer* buf, const void* data, size_t size) {
+    if (buf->size + size > buf->capacity) {
+        buf->capacity = (buf->size + size) * 2;
+        buf->data = realloc(buf->data, buf->capacity);
+        if (buf->data == NULL) {
+            perror("library");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(&buf->data[buf->size], data, size);
+    buf->size += size;
+    return buf->size - size;
+}
+
+char* ReadTextFile(const char* path) {
+    Rom file;
+    RomInit(&file, path);
+    char* text = realloc(file.data, file.size + 1);
+    text[file.size] = '\0';
+    return text;
+}
+
+// Fills in the entry's metadata from the ROM's "<rom>.cfg", if there is one.
+void ReadRomMetadata(const char* rom_path, Buffer* strings, LibraryEntry* entry) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.cfg", rom_path);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return ;
+    }
+    char buf[1024];
+    for (size_t line = 1; fgets(buf, sizeof(buf), file) != NULL; ++line) {
+        char* comment = strchr(buf, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char* value = strchr(buf, '=');
+        char* name = TrimSpace(buf);
+        if (*name == '\0') {
+            continue;
+        }
+        if (value == NULL) {
+            fprintf(stderr, "%s:%zu: expected \"name = value\"\n", path, line);
+            exit(EXIT_FAILURE);
+        }
+        *value++ = '\0';
+        name = TrimSpace(name);
+        value = TrimSpace(value);
+        unsigned long long hz = 0;
+        bool ok = true;
+        if (strcmp(name, "title") == 0) {
+            entry->title = BufferAppend(strings, value, strlen(value) + 1);
+        } else if (strcmp(name, "quirks") == 0) {
+            ok = ParseQuirks(value, &entry->quirks);
+        } else if (strcmp(name, "cpu-hz") == 0) {
+            ok = ParseNumber(value, 1000000000, &hz) && hz >= 1;
+            entry->cpu_hz = hz;
+        } else if (strcmp(name, "keymap") == 0) {
+            // Relative to the metadata file.
+            char keymap_path[8192];
+            const char* slash = strrchr(path, '/');
+            snprintf(keymap_path, sizeof(keymap_path), "%.*s%s", value[0] == '/' || slash == NULL ? 0 : (int)(slash - path + 1), path, value);
+            char* text = ReadTextFile(keymap_path);
+            FILE* keymap_file = fmemopen(text, strlen(text), "r");
+            Keymap parsed;
+            ok = ParseKeymap(&parsed, keymap_file, keymap_path);
+            fclose(keymap_file);
+            entry->keymap = BufferAppend(strings, text, strlen(text) + 1);
+            free(text);
+        } else {
+            fprintf(stderr, "%s:%zu: unknown setting \"%s\"\n", path, line, name);
+            exit(EXIT_FAILURE);
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%zu: invalid value for %s: %s\n", path, line, name, value);
+            exit(EXIT_FAILURE);
         }
-        case SDLK_d: {
-            key = KEY_9;
-            break;
+    }
+    fclose(file);
+    return ;
+}
+
+int CompareEntries(const void* a, const void* b) {
+    return memcmp(((const LibraryEntry*)a)->sha1, ((const LibraryEntry*)b)->sha1, SHA1_SIZE);
+}
+
+// Writes an index of the given ROMs to path, through a temporary file and rename.
+void LibraryBuild(const char* path, char** roms, int count) {
+    LibraryEntry* entries = calloc(count, sizeof(LibraryEntry));
+    // Strings and images, at offsets relative to the end of the entries.
+    Buffer data = {0};
+    // Offset 0 means "none", so no string may start there.
+    BufferAppend(&data, "", 1);
+    for (int i = 0; i < count; ++i) {
+        Rom rom;
+        RomInit(&rom, roms[i]);
+        if (rom.size > NUM_RAM - PROGRAM_START) {
+            fprintf(stderr, "%s: rom is %zu bytes, only %d fit in ram\n", roms[i], rom.size, NUM_RAM - PROGRAM_START);
+            exit(EXIT_FAILURE);
         }
-        case SDLK_f: {
-            key = KEY_E;
-            break;
+        LibraryEntry* entry = &entries[i];
+        Sha1Digest(rom.data, rom.size, entry->sha1);
+        entry->quirks = UsesSuperChip(rom.data, rom.size) ? QUIRKS_SCHIP : QUIRKS_DEFAULT;
+        entry->cpu_hz = CYCLES_PER_FRAME * FRAME_RATE;
+        ReadRomMetadata(roms[i], &data, entry);
+        if (entry->title == 0) {
+            const char* base = strrchr(roms[i], '/') != NULL ? strrchr(roms[i], '/') + 1 : roms[i];
+            entry->title = BufferAppend(&data, base, strcspn(base, "."));
+            BufferAppend(&data, "", 1);
         }
-        case SDLK_z: {
-            key = KEY_A;
-            break;
+        entry->image = BufferAppend(&data, rom.data, rom.size);
+        entry->image_size = rom.size;
+        free(rom.data);
+    }
+    qsort(entries, count, sizeof(LibraryEntry), CompareEntries);
+
+    LibraryHeader header = {LIBRARY_MAGIC, htole32(LIBRARY_VERSION), 0, htole32(sizeof(LibraryHeader))};
+    uint32_t data_start = sizeof(LibraryHeader) + count * sizeof(LibraryEntry);
+    uint32_t unique = 0;
+    for (int i = 0; i < count; ++i) {
+        if (unique > 0 && CompareEntries(&entries[unique - 1], &entries[i]) == 0) {
+            char digest[2 * SHA1_SIZE + 1];
+            FormatSha1(entries[i].sha1, digest);
+            fprintf(stderr, "%s: duplicate of an earlier ROM, skipped\n", digest);
+            continue;
         }
-        case SDLK_x: {
-            key = KEY_0;
-            break;
+        LibraryEntry* entry = &entries[unique++];
+        *entry = entries[i];
+        entry->title = htole32(entry->title + data_start);
+        entry->keymap = entry->keymap != 0 ? htole32(entry->keymap + data_start) : 0;
+        entry->image = htole32(entry->image + data_start);
+        entry->image_size = htole32(entry->image_size);
+        entry->cpu_hz = htole32(entry->cpu_hz);
+    }
+    header.count = htole32(unique);
+    // Entries dropped as duplicates leave a gap before the data, which keeps offsets valid.
+    memset(&entries[unique], 0, (count - unique) * sizeof(LibraryEntry));
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        perror(tmp_path);
+        exit(EXIT_FAILURE);
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(entries, sizeof(LibraryEntry), count, file);
+    fwrite(data.data, 1, data.size, file);
+    if (fclose(file) == EOF || rename(tmp_path, path) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "%s: %" PRIu32 " ROMs\n", path, unique);
+    free(entries);
+    free(data.data);
+    return ;
+}
+
+// Applies a library entry's settings to config.
+void LibraryApply(const Library* lib, const LibraryEntry* entry, Config* config) {
+    config->title = LibraryString(lib, le32toh(entry->title));
+    config->keymap_text = entry->keymap != 0 ? LibraryString(lib, le32toh(entry->keymap)) : NULL;
+    config->quirks = entry->quirks;
+    config->cycles_per_frame = CyclesPerFrame(le32toh(entry->cpu_hz));
+    config->rom_data = &lib->base[le32toh(entry->image)];
+    config->rom_size = le32toh(entry->image_size);
+    return ;
+}
+
+void ConfigDefaults(Config* config) {
+    memset(config, 0, sizeof(Config));
+    config->render_mode = RENDER_LEGACY;
+    config->decay = DEFAULT_DECAY;
+    config->scale = DEFAULT_SCALE;
+    config->cycles_per_frame = CYCLES_PER_FRAME;
+    config->quirks = QUIRKS_DEFAULT;
+    config->turbo_ratio = DEFAULT_TURBO_RATIO;
+    config->input_delay = DEFAULT_INPUT_DELAY;
+    return ;
+}
+
+// Applies the options in argv to config. Returns the index of the first non-option argument.
+int ApplyCommandLine(Config* config, int argc, char** argv) {
+    char short_options[2 * NUM_CONFIG_OPTIONS + 1];
+    struct option long_options[NUM_CONFIG_OPTIONS + 1];
+    size_t nshort = 0;
+    for (size_t i = 0; i < NUM_CONFIG_OPTIONS; ++i) {
+        const ConfigOption* option = &config_options[i];
+        if (option->id < OPT_SCALE) {
+            short_options[nshort++] = option->id;
+            if (option->arg != NULL) {
+                short_options[nshort++] = ':';
+            }
         }
-        case SDLK_c: {
-            key = KEY_B;
-            break;
+        long_options[i] = (struct option){option->name, option->arg != NULL ? required_argument : no_argument, NULL, option->id};
+    }
+    short_options[nshort] = '\0';
+    long_options[NUM_CONFIG_OPTIONS] = (struct option){NULL, 0, NULL, 0};
+
+    // 0 rather than 1 makes getopt start over when called a second time.
+    optind = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        ApplyOption(config, opt, optarg, "command line", 0);
+    }
+    return optind;
+}
+
+// Fills config from argv, or prints usage and exits.
+void ResolveConfig(Config* config, int argc, char** argv) {
+    ConfigDefaults(config);
+    int first = ApplyCommandLine(config, argc, argv);
+    if (config->build_library_path != NULL) {
+        config->library_roms = &argv[first];
+        config->library_rom_count = argc - first;
+        return ;
+    }
+    if (config->list_library && config->library_path != NULL) {
+        LibraryOpen(&library, config->library_path);
+        return ;
+    }
+    if (first != argc - 1) {
+        Usage();
+        exit(EXIT_FAILURE);
+    }
+    config->rom_path = argv[first];
+    config->title = config->rom_path;
+    if (config->library_path != NULL) {
+        LibraryOpen(&library, config->library_path);
+        const LibraryEntry* entry = LibraryFind(&library, config->rom_path);
+        if (entry == NULL) {
+            fprintf(stderr, "%s: not in %s\n", config->rom_path, config->library_path);
+            exit(EXIT_FAILURE);
         }
-        case SDLK_v: {
-            key = KEY_F;
-            break;
+        // The library's settings for the ROM stand in for the defaults; the command line
+        // still overrides them.
+        ConfigDefaults(config);
+        LibraryApply(&library, entry, config);
+        ApplyCommandLine(config, argc, argv);
+        config->rom_path = argv[first];
+    }
+    if (config->netplay && config->debug) {
+        fprintf(stderr, "the debugger cannot be used in netplay\n");
+        exit(EXIT_FAILURE);
+    }
+    return ;
+}
+
+// Input recordings: a header holding what the run depends on besides input, then the
+// key mask held in each emulated frame, as little-endian 16-bit words.
+typedef struct {
+    char magic[4];
+    uint32_t seed;
+    uint32_t cycles_per_frame;
+    uint8_t quirks;
+} __attribute__((packed)) RecordingHeader;
+
+#define RECORDING_MAGIC "C8IN"
+
+FILE* OpenRecording(const Config* config) {
+    FILE* file = fopen(config->record_path, "wb");
+    if (file == NULL) {
+        perror(config->record_path);
+        exit(EXIT_FAILURE);
+    }
+    RecordingHeader header = {RECORDING_MAGIC, htole32(config->seed), htole32(config->cycles_per_frame), config->quirks};
+    fwrite(&header, sizeof(header), 1, file);
+    return file;
+}
+
+// Opens a recording, insisting it was made with the same seed, speed and quirks, since
+// replaying under others would play a different game.
+FILE* OpenReplay(const Config* config) {
+    FILE* file = fopen(config->replay_path, "rb");
+    if (file == NULL) {
+        perror(config->replay_path);
+        exit(EXIT_FAILURE);
+    }
+    RecordingHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, RECORDING_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s: not an input recording\n", config->replay_path);
+        exit(EXIT_FAILURE);
+    }
+    if (le32toh(header.seed) != config->seed || le32toh(header.cycles_per_frame) != config->cycles_per_frame || header.quirks != config->quirks) {
+        fprintf(stderr, "%s: recorded with --seed=%" PRIu32 " --cpu-hz=%" PRIu32 " and quirks 0x%02x; run with the same settings\n",
+                config->replay_path, le32toh(header.seed), le32toh(header.cycles_per_frame) * FRAME_RATE, header.quirks);
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+void WriteKeyMask(FILE* file, uint16_t mask) {
+    uint16_t le = htole16(mask);
+    fwrite(&le, sizeof(le), 1, file);
+    return ;
+}
+
+bool ReadKeyMask(FILE* file, uint16_t* mask) {
+    uint16_t le;
+    if (fread(&le, sizeof(le), 1, file) != 1) {
+        return false;
+    }
+    *mask = le16toh(le);
+    return true;
+}
+
+// Save states are the whole machine, behind a magic and the struct size so a state from an
+// incompatible build is rejected rather than misread. A state carries its own quirks and speed.
+#define STATE_MAGIC "C8ST"
+
+bool SaveState(const char* path, const Chip8* machine) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    uint32_t size = sizeof(Chip8);
+    bool ok = fwrite(STATE_MAGIC, 4, 1, file) == 1 && fwrite(&size, sizeof(size), 1, file) == 1 && fwrite(machine, sizeof(Chip8), 1, file) == 1;
+    if (fclose(file) != 0 || !ok) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+bool LoadState(const char* path, Chip8* machine) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    char magic[4];
+    uint32_t size = 0;
+    Chip8 state;
+    bool ok = fread(magic, 4, 1, file) == 1 && memcmp(magic, STATE_MAGIC, 4) == 0
+              && fread(&size, sizeof(size), 1, file) == 1 && size == sizeof(Chip8)
+              && fread(&state, sizeof(Chip8), 1, file) == 1;
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "%s: not a save state from this build\n", path);
+        return false;
+    }
+    state.event_ring = machine->event_ring;
+    // Older builds let pc run past the end of ram.
+    state.pc &= ADDR_MASK;
+    *machine = state;
+    return true;
+}
+
+// Records in the shared memory event ring: at 12 bytes each, 768 KiB, a few seconds of even a
+// busy game's draws and ram changes.
+#define EVENT_RING_CAPACITY (1 << 16)
+
+// Creates the shared memory object name holding an event ring and attaches it to the machine.
+// Readers map the same name; see EventRing in chip8.h.
+void OpenEventRing(const char* name, Chip8* machine) {
+    size_t size = EventRingSize(EVENT_RING_CAPACITY);
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    EventRing* ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    AttachEventRing(machine, ring, EVENT_RING_CAPACITY);
+    return ;
+}
+
+void CloseEventRing(const char* name, Chip8* machine) {
+    munmap(machine->event_ring, EventRingSize(EVENT_RING_CAPACITY));
+    machine->event_ring = NULL;
+    shm_unlink(name);
+    return ;
+}
+
+// Runs n instructions one at a time, printing each before it executes.
+void TraceCycles(Chip8* machine, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        uint16_t pc = machine->pc & ADDR_MASK;
+        uint16_t instruction = machine->ram[(pc + 1) & ADDR_MASK] | machine->ram[pc] << 8;
+        fprintf(stderr, "%03" PRIx16 ": %04" PRIx16 "  I=%03" PRIx16 " V=", pc, instruction, machine->reg_i);
+        for (uint8_t reg = 0; reg < NUM_REG; ++reg) {
+            fprintf(stderr, "%02x", machine->registers[reg]);
         }
-        default: {
-            fprintf(stderr, "Uknown keycode: %d\n", code);
-            fflush(stderr);
-            key = KEY_UNKNOWN;
-            // exit(EXIT_FAILURE);
+        fprintf(stderr, "\n");
+        if (EmulateCycle(machine) != FAULT_NONE) {
+            return ;
+        }
+    }
+    return ;
+}
+
+// Netplay. Two instances run the same deterministic machine in lockstep over UDP, exchanging
+// only the keys each player holds per frame; the machine sees both players' keys ORed together.
+// A player's keys take effect input_delay frames after they are read, which hides that much
+// latency outright. Past that, frames run on a prediction of the peer's keys (the last ones
+// seen), and when the real ones arrive and differ, the machine is restored to the state saved
+// before the first mispredicted frame and re-run up to the present. Every
+// NETPLAY_CHECK_INTERVAL frames the peers compare checksums of a confirmed state to catch a
+// desync.
+#define NETPLAY_WINDOW 128
+// How far the machine may run ahead of the peer's confirmed keys before waiting for them.
+#define NETPLAY_MAX_ROLLBACK 32
+#define NETPLAY_MAX_PACKET_INPUTS 32
+#define NETPLAY_CHECK_INTERVAL 60
+#define NETPLAY_CHECK_HISTORY 8
+#define NETPLAY_RESEND_NS 5000000
+#define NETPLAY_TIMEOUT_NS 10000000000ull
+#define NETPLAY_MAGIC "C8NP"
+
+// All fields little-endian. masks[i] is the sender's keys for frame first_frame + i.
+typedef struct {
+    char magic[4];
+    // Hash of the ROM and the settings the machine depends on, so mismatched peers refuse to play.
+    uint32_t session;
+    // How many of the receiver's frames of keys the sender has.
+    uint32_t ack;
+    // The sender's checksum of the state at the start of check_frame, or check_frame 0 for none.
+    uint32_t check_frame;
+    uint32_t checksum;
+    uint32_t first_frame;
+    uint8_t count;
+    uint16_t masks[NETPLAY_MAX_PACKET_INPUTS];
+} __attribute__((packed)) NetPacket;
+
+typedef struct {
+    uint32_t frame;
+    uint32_t checksum;
+} NetCheck;
+
+typedef struct {
+    int fd;
+    uint32_t session;
+    uint32_t input_delay;
+    // Frames run so far, i.e. the next one to run.
+    uint32_t frame;
+    // Frames of keys known from each side. Both start at input_delay, the frames before any
+    // keys can take effect being empty.
+    uint32_t local_count;
+    uint32_t remote_count;
+    uint32_t peer_ack;
+    // Rings indexed by frame % NETPLAY_WINDOW.
+    uint16_t local_inputs[NETPLAY_WINDOW];
+    uint16_t remote_inputs[NETPLAY_WINDOW];
+    // The remote keys each frame ran with, predicted or not.
+    uint16_t used_remote[NETPLAY_WINDOW];
+    // The machine at the start of each frame, and the frame number its event ring had then.
+    Chip8 states[NETPLAY_WINDOW];
+    uint32_t event_frames[NETPLAY_WINDOW];
+    // Checksums of confirmed states, from this side and from the peer.
+    NetCheck local_checks[NETPLAY_CHECK_HISTORY];
+    NetCheck remote_checks[NETPLAY_CHECK_HISTORY];
+    // The latest of local_checks, sent with every packet.
+    NetCheck last_check;
+    uint64_t last_send_ns;
+    uint64_t last_receive_ns;
+    uint64_t rollbacks;
+    uint64_t rollback_frames;
+} Netplay;
+
+uint32_t StateChecksum(const Chip8* machine) {
+    uint32_t crc = Crc32(0, machine->ram, NUM_RAM);
+    crc = Crc32(crc, machine->registers, NUM_REG);
+    return Crc32(crc, (const uint8_t*)machine->logical_pixels, DISPLAY_BYTES);
+}
+
+void NetplaySend(Netplay* net) {
+    NetPacket packet;
+    memcpy(packet.magic, NETPLAY_MAGIC, 4);
+    packet.session = htole32(net->session);
+    packet.ack = htole32(net->remote_count);
+    packet.check_frame = htole32(net->last_check.frame);
+    packet.checksum = htole32(net->last_check.checksum);
+    // Resend everything the peer has not acknowledged, oldest first.
+    uint32_t first = net->peer_ack;
+    if (net->local_count - first > NETPLAY_WINDOW) {
+        first = net->local_count - NETPLAY_WINDOW;
+    }
+    uint32_t count = net->local_count - first;
+    count = count > NETPLAY_MAX_PACKET_INPUTS ? NETPLAY_MAX_PACKET_INPUTS : count;
+    packet.first_frame = htole32(first);
+    packet.count = count;
+    for (uint32_t i = 0; i < count; ++i) {
+        packet.masks[i] = htole16(net->local_inputs[(first + i) % NETPLAY_WINDOW]);
+    }
+    // Datagrams can be lost anyway, and the peer asking again covers a refused send.
+    send(net->fd, &packet, offsetof(NetPacket, masks) + count * sizeof(uint16_t), MSG_DONTWAIT);
+    net->last_send_ns = NowNs();
+    return ;
+}
+
+// Runs the next frame with both sides' keys, saving the state it starts from.
+void NetplayRunFrame(Netplay* net, Chip8* machine) {
+    uint32_t slot = net->frame % NETPLAY_WINDOW;
+    uint16_t remote = net->remote_inputs[(net->frame < net->remote_count ? net->frame : net->remote_count - 1) % NETPLAY_WINDOW];
+    net->states[slot] = *machine;
+    if (machine->event_ring != NULL) {
+        net->event_frames[slot] = atomic_load_explicit(&machine->event_ring->frame, memory_order_relaxed);
+    }
+    net->used_remote[slot] = remote;
+    SetKeyMask(machine, net->local_inputs[slot] | remote);
+    RunFrame(machine, 0);
+    ++net->frame;
+    return ;
+}
+
+// Records a checksum and compares it with the peer's for the same frame. Returns false on a
+// mismatch.
+bool NetplayRecordCheck(Netplay* net, NetCheck* history, NetCheck check) {
+    uint32_t slot = check.frame / NETPLAY_CHECK_INTERVAL % NETPLAY_CHECK_HISTORY;
+    history[slot] = check;
+    NetCheck local = net->local_checks[slot];
+    NetCheck remote = net->remote_checks[slot];
+    if (local.frame == remote.frame && local.checksum != remote.checksum) {
+        fprintf(stderr, "netplay: desync at frame %" PRIu32 " (checksum %08" PRIx32 " here, %08" PRIx32 " on the peer)\n",
+                check.frame, local.checksum, remote.checksum);
+        return false;
+    }
+    return true;
+}
+
+// Checksums the newest checkpoint whose frames all ran on confirmed keys, so both sides
+// checksum the same state.
+bool NetplayCheck(Netplay* net, const Chip8* machine) {
+    uint32_t confirmed = net->frame < net->remote_count ? net->frame : net->remote_count;
+    uint32_t frame = confirmed / NETPLAY_CHECK_INTERVAL * NETPLAY_CHECK_INTERVAL;
+    if (frame == 0 || frame == net->last_check.frame) {
+        return true;
+    }
+    const Chip8* state = frame == net->frame ? machine : &net->states[frame % NETPLAY_WINDOW];
+    net->last_check = (NetCheck){frame, StateChecksum(state)};
+    return NetplayRecordCheck(net, net->local_checks, net->last_check);
+}
+
+// Takes in every packet waiting, re-running from the first frame that ran on mispredicted keys.
+// Returns false on a desync or a packet from a different session.
+bool NetplayReceive(Netplay* net, Chip8* machine) {
+    uint32_t rollback_from = UINT32_MAX;
+    NetPacket packet;
+    ssize_t size;
+    while ((size = recv(net->fd, &packet, sizeof(packet), MSG_DONTWAIT)) > 0) {
+        if ((size_t)size < offsetof(NetPacket, masks) || memcmp(packet.magic, NETPLAY_MAGIC, 4) != 0) {
+            continue;
+        }
+        if (le32toh(packet.session) != net->session) {
+            fprintf(stderr, "netplay: the peer is running a different ROM or settings\n");
+            return false;
+        }
+        net->last_receive_ns = NowNs();
+        uint32_t ack = le32toh(packet.ack);
+        net->peer_ack = ack > net->peer_ack && ack <= net->local_count ? ack : net->peer_ack;
+        uint32_t first = le32toh(packet.first_frame);
+        uint32_t count = packet.count;
+        if (count > NETPLAY_MAX_PACKET_INPUTS || (size_t)size < offsetof(NetPacket, masks) + count * sizeof(uint16_t)) {
+            continue;
+        }
+        // Keys arrive in order; skip ones already known and stop at a gap.
+        for (uint32_t f = first; f < first + count && f <= net->remote_count; ++f) {
+            if (f < net->remote_count) {
+                continue;
+            }
+            if (f >= net->frame + NETPLAY_WINDOW - NETPLAY_MAX_ROLLBACK) {
+                break;
+            }
+            uint16_t mask = le16toh(packet.masks[f - first]);
+            net->remote_inputs[f % NETPLAY_WINDOW] = mask;
+            if (f < net->frame && net->used_remote[f % NETPLAY_WINDOW] != mask && f < rollback_from) {
+                rollback_from = f;
+            }
+            ++net->remote_count;
+        }
+        uint32_t check_frame = le32toh(packet.check_frame);
+        if (check_frame != 0 && !NetplayRecordCheck(net, net->remote_checks, (NetCheck){check_frame, le32toh(packet.checksum)})) {
+            return false;
+        }
+    }
+
+    if (rollback_from != UINT32_MAX) {
+        uint32_t present = net->frame;
+        *machine = net->states[rollback_from % NETPLAY_WINDOW];
+        if (machine->event_ring != NULL) {
+            RewindEventRing(machine, net->event_frames[rollback_from % NETPLAY_WINDOW]);
+        }
+        net->frame = rollback_from;
+        while (net->frame < present && machine->fault == FAULT_NONE) {
+            NetplayRunFrame(net, machine);
+        }
+        ++net->rollbacks;
+        net->rollback_frames += present - rollback_from;
+    }
+    return NetplayCheck(net, machine);
+}
+
+// Waits up to a resend interval for a packet, resending our keys when it is due.
+void NetplayWait(Netplay* net) {
+    if (NowNs() - net->last_send_ns >= NETPLAY_RESEND_NS) {
+        NetplaySend(net);
+    }
+    struct pollfd pfd = {.fd = net->fd, .events = POLLIN};
+    poll(&pfd, 1, NETPLAY_RESEND_NS / 1000000);
+    return ;
+}
+
+// Binds to port and waits for a peer, or, given a "host:port" peer, connects to it.
+Netplay* NetplayInit(const Config* config, const Rom* rom) {
+    Netplay* net = calloc(1, sizeof(Netplay));
+    net->input_delay = config->input_delay;
+    net->local_count = config->input_delay;
+    net->remote_count = config->input_delay;
+    // Tie the session to everything the emulation depends on besides input.
+    uint32_t settings[] = {htole32(config->seed), htole32(config->cycles_per_frame), config->quirks, htole32(config->input_delay)};
+    net->session = Crc32(Crc32(0, rom->data, rom->size), (const uint8_t*)settings, sizeof(settings));
+
+    net->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (net->fd == -1) {
+        perror("netplay socket");
+        exit(EXIT_FAILURE);
+    }
+    if (config->netplay_peer == NULL) {
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(config->netplay_port),
+            .sin_addr.s_addr = htonl(INADDR_ANY),
+        };
+        if (bind(net->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            perror("netplay bind");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "netplay: waiting for a peer on port %d\n", config->netplay_port);
+        // The first packet from the right session tells us who the peer is.
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        NetPacket packet;
+        for (;;) {
+            ssize_t size = recvfrom(net->fd, &packet, sizeof(packet), MSG_PEEK, (struct sockaddr*)&peer, &peer_len);
+            if (size == -1) {
+                perror("netplay recvfrom");
+                exit(EXIT_FAILURE);
+            }
+            if ((size_t)size >= offsetof(NetPacket, masks) && memcmp(packet.magic, NETPLAY_MAGIC, 4) == 0) {
+                break;
+            }
+            recv(net->fd, &packet, sizeof(packet), 0);
+        }
+        if (connect(net->fd, (struct sockaddr*)&peer, peer_len) == -1) {
+            perror("netplay connect");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        char host[256];
+        snprintf(host, sizeof(host), "%s", config->netplay_peer);
+        char* port = strrchr(host, ':');
+        *port++ = '\0';
+        struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+        struct addrinfo* addr = NULL;
+        int err = getaddrinfo(host, port, &hints, &addr);
+        if (err != 0) {
+            fprintf(stderr, "netplay: %s: %s\n", config->netplay_peer, gai_strerror(err));
+            exit(EXIT_FAILURE);
+        }
+        if (connect(net->fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+            perror("netplay connect");
+            exit(EXIT_FAILURE);
+        }
+        freeaddrinfo(addr);
+        fprintf(stderr, "netplay: connecting to %s\n", config->netplay_peer);
+    }
+
+    // Say hello until the peer answers.
+    uint64_t start = NowNs();
+    net->last_receive_ns = 0;
+    while (net->last_receive_ns == 0) {
+        if (NowNs() - start > NETPLAY_TIMEOUT_NS) {
+            fprintf(stderr, "netplay: no answer from the peer\n");
+            exit(EXIT_FAILURE);
+        }
+        NetplayWait(net);
+        // No frame has run yet, so there is nothing to roll back and no machine is needed.
+        if (!NetplayReceive(net, NULL)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    NetplaySend(net);
+    fprintf(stderr, "netplay: connected\n");
+    return net;
+}
+
+// Runs one frame with local_keys as this player's keys for input_delay frames from now.
+// Returns false if the peer went away or the machines diverged.
+bool NetplayAdvance(Netplay* net, Chip8* machine, uint16_t local_keys) {
+    net->local_inputs[net->local_count % NETPLAY_WINDOW] = local_keys;
+    ++net->local_count;
+    NetplaySend(net);
+    if (!NetplayReceive(net, machine)) {
+        return false;
+    }
+    // Keep every frame that may need re-running inside the window of saved states.
+    while (net->frame >= net->remote_count + NETPLAY_MAX_ROLLBACK) {
+        if (NowNs() - net->last_receive_ns > NETPLAY_TIMEOUT_NS) {
+            fprintf(stderr, "netplay: the peer stopped responding\n");
+            return false;
+        }
+        NetplayWait(net);
+        if (!NetplayReceive(net, machine)) {
+            return false;
+        }
+    }
+    NetplayRunFrame(net, machine);
+    return NetplayCheck(net, machine);
+}
+
+// Waits for the peer's keys for every frame run, so the final state is the confirmed one, and
+// for the peer to have all of ours.
+bool NetplayFinish(Netplay* net, Chip8* machine) {
+    while (net->remote_count < net->frame || net->peer_ack < net->local_count) {
+        if (NowNs() - net->last_receive_ns > NETPLAY_TIMEOUT_NS) {
+            fprintf(stderr, "netplay: the peer stopped responding\n");
+            return false;
+        }
+        NetplayWait(net);
+        if (!NetplayReceive(net, machine)) {
+            return false;
         }
     }
+    NetplaySend(net);
+    fprintf(stderr, "netplay: %" PRIu32 " frames, %" PRIu64 " rollbacks re-running %" PRIu64 " frames\n",
+            net->frame, net->rollbacks, net->rollback_frames);
+    return true;
+}
+
+// Set from the SDL event loop, or from SIGUSR1 when running headless.
+volatile sig_atomic_t snapshot_requested = 0;
+bool quit_requested = false;
+// Toggled with Tab; see -T.
+bool turbo_enabled = false;
+// Set by F2 and F3 when --save-state or --load-state is given.
+bool save_state_requested = false;
+bool load_state_requested = false;
+// With turbo ratio "max", emulate for this much of each host frame before presenting.
+#define TURBO_BUDGET_NS (FRAME_PERIOD_NS * 3 / 4)
+
+void RequestSnapshot(int signum) {
+    (void)signum;
+    snapshot_requested = 1;
+    return ;
+}
 
-    return key;
+// Handles emulator hotkeys. Returns false if the key is not one.
+bool HandleHotkey(SDL_Keycode code) {
+    switch (code) {
+        case SDLK_F1: {
+            overlay_enabled = !overlay_enabled;
+            return true;
+        }
+        case SDLK_F2: {
+            save_state_requested = true;
+            return true;
+        }
+        case SDLK_F3: {
+            load_state_requested = true;
+            return true;
+        }
+        case SDLK_F5: {
+            keymap_reload_requested = 1;
+            return true;
+        }
+        case SDLK_F12: {
+            snapshot_requested = 1;
+            return true;
+        }
+        case SDLK_TAB: {
+            turbo_enabled = !turbo_enabled;
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
 }
 
-Key ReadInput() {
+Key ReadInput(Chip8* machine, const Config* config) {
+    if (keymap_reload_requested) {
+        keymap_reload_requested = 0;
+        if (LoadKeymap(config->keymap_path, config->keymap_text)) {
+            fprintf(stderr, "reloaded keymap\n");
+        }
+    }
+
     SDL_Event e;
     Key last_key = KEY_UNKNOWN;
     while (SDL_PollEvent(&e)) {
-        if (e.type == SDL_QUIT) {
-            exit(EXIT_SUCCESS);
+        Key key = KEY_UNKNOWN;
+        bool down = false;
+        switch (e.type) {
+            case SDL_QUIT: {
+                quit_requested = true;
+                break;
+            }
+            case SDL_KEYDOWN:
+            case SDL_KEYUP: {
+                down = e.type == SDL_KEYDOWN;
+                if (down && HandleHotkey(e.key.keysym.sym)) {
+                    break;
+                }
+                key = keymap.scancodes[e.key.keysym.scancode];
+                break;
+            }
+            case SDL_CONTROLLERBUTTONDOWN:
+            case SDL_CONTROLLERBUTTONUP: {
+                down = e.type == SDL_CONTROLLERBUTTONDOWN;
+                key = e.cbutton.button < SDL_CONTROLLER_BUTTON_MAX ? keymap.buttons[e.cbutton.button] : KEY_UNKNOWN;
+                break;
+            }
+            case SDL_CONTROLLERDEVICEADDED: {
+                if (SDL_GameControllerOpen(e.cdevice.which) == NULL) {
+                    fprintf(stderr, "Failed to open game controller! SDL Error: %s\n", SDL_GetError());
+                }
+                break;
+            }
+            default: {
+                break;
+            }
         }
-        Key key = MapKeycode(e.key.keysym.sym);
-        keys[key] = e.type == SDL_KEYDOWN;
-        last_key = e.type == SDL_KEYDOWN ? key : last_key;
+        if (key == KEY_UNKNOWN) {
+            continue;
+        }
+        machine->keys[key] = down;
+        last_key = down ? key : last_key;
     }
 
     return last_key;
 }
 
 int main(int argc, char** argv) {
+    Config settings;
+    ResolveConfig(&settings, argc, argv);
+    const Config* config = &settings;
+    turbo_enabled = config->turbo;
+    if (config->build_library_path != NULL) {
+        LibraryBuild(config->build_library_path, config->library_roms, config->library_rom_count);
+        exit(EXIT_SUCCESS);
+    }
+    if (config->list_library) {
+        LibraryList(&library);
+        exit(EXIT_SUCCESS);
+    }
 
+    Rom rom;
+    if (config->rom_data != NULL) {
+        rom.data = (uint8_t*)config->rom_data;
+        rom.size = config->rom_size;
+    } else {
+        RomInit(&rom, config->rom_path);
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: main <rom-filename>\n");
-        fflush(stderr);
+    Chip8* machine = calloc(1, sizeof(Chip8));
+    InitCHIP8(machine);
+    machine->cycles_per_frame = config->cycles_per_frame;
+    machine->quirks = config->quirks;
+    SeedRandom(machine, config->seed);
+    if (!LoadProgram(machine, rom.data, rom.size)) {
+        fprintf(stderr, "%s: rom is %zu bytes, only %d fit in ram\n", config->rom_path, rom.size, NUM_RAM - PROGRAM_START);
         exit(EXIT_FAILURE);
     }
-    
-    const char* rom_filename = argv[1];
-    Rom rom;
-    RomInit(&rom, rom_filename);
+    if (config->load_state_path != NULL && !LoadState(config->load_state_path, machine)) {
+        exit(EXIT_FAILURE);
+    }
+    if (config->events_name != NULL) {
+        OpenEventRing(config->events_name, machine);
+    }
+    FILE* recording = config->record_path != NULL ? OpenRecording(config) : NULL;
+    FILE* replay = config->replay_path != NULL ? OpenReplay(config) : NULL;
+    if (!config->headless) {
+        char title[256];
+        snprintf(title, sizeof(title), "chip8 - %s", config->title);
+        InitGraphics(title, config->scale, config->render_mode, config->fullscreen, config->vsync);
+    }
+    signal(SIGUSR1, RequestSnapshot);
+    signal(SIGHUP, RequestKeymapReload);
+    if (!LoadKeymap(config->keymap_path, config->keymap_text)) {
+        exit(EXIT_FAILURE);
+    }
+    Netplay* net = config->netplay ? NetplayInit(config, &rom) : NULL;
+    // In netplay the machine's keys are both players'; this player's are kept here.
+    uint16_t local_keys = 0;
+    if (config->debug) {
+        DebuggerInit(config->debug_port);
+        // Stop before the first instruction.
+        debugger.stepping = true;
+        debugger.steps_left = 0;
+        DebuggerUpdateArmed();
+    }
 
-    InitCHIP8();
-    memcpy(&ram[0x200], rom.data, rom.size);
-    InitGraphics();
+    VideoStream video;
+    if (config->video_path != NULL) {
+        VideoStreamInit(&video, config->video_path, config->headless || config->video_lossless);
+    }
 
-    for (;;) {
-        ReadInput();
-        EmulateCycle();
-        Render();
-        usleep(1200);
+    FrameStats stats;
+    FrameStatsInit(&stats, config->timing_path);
+    MetricsWriter metrics_writer;
+    if (config->metrics_path != NULL) {
+        MetricsWriterInit(&metrics_writer, config->metrics_path);
+    }
+    MetricsSample overlay_prev;
+    MetricsSample overlay_cur;
+    MetricsReport overlay_report;
+    MetricsTakeSample(&overlay_prev);
+    MetricsCompute(&overlay_prev, &overlay_prev, &overlay_report);
+    uint64_t deadline = NowNs();
+    unsigned long frames = 0;
+    int exit_status = EXIT_SUCCESS;
+    while (!quit_requested) {
+        uint64_t start = NowNs();
+        if (net != NULL) {
+            SetKeyMask(machine, local_keys);
+        }
+        if (!config->headless && ReadInput(machine, config) != KEY_UNKNOWN) {
+            FrameStatsKeyRead(&stats, machine, start);
+        }
+        uint64_t input_done = NowNs();
+        if (debugger.enabled && !debugger.armed && DebuggerInputPending()) {
+            char line[256];
+            fgets(line, sizeof(line), debugger.in);
+            debugger.stepping = true;
+            debugger.steps_left = 0;
+            DebuggerUpdateArmed();
+        }
+        if (save_state_requested && config->save_state_path != NULL && SaveState(config->save_state_path, machine)) {
+            fprintf(stderr, "saved state to %s\n", config->save_state_path);
+        }
+        // Loading a state on one side only would desync a netplay session.
+        if (load_state_requested && net == NULL && config->load_state_path != NULL && LoadState(config->load_state_path, machine)) {
+            fprintf(stderr, "loaded state from %s\n", config->load_state_path);
+        }
+        save_state_requested = false;
+        load_state_requested = false;
+        uint64_t frame_start_cycles = machine->cycles;
+        // In turbo mode several emulated frames run per presented one. The timers still tick
+        // once per emulated frame, so the game sees normal time, just more of it per second.
+        unsigned long batch = 0;
+        unsigned long due = !config->headless && config->vsync && !vsync_paced ? FramesDue(&deadline) : 1;
+        bool halted = false;
+        bool limit_reached = false;
+        while (!limit_reached && (batch < due || (batch > 0 && turbo_enabled && (config->turbo_ratio == 0 ? NowNs() - start < TURBO_BUDGET_NS : batch < config->turbo_ratio)))) {
+            if (replay != NULL) {
+                uint16_t mask;
+                if (!ReadKeyMask(replay, &mask)) {
+                    fprintf(stderr, "%s: end of replay after %lu frames\n", config->replay_path, frames);
+                    halted = true;
+                    break;
+                }
+                SetKeyMask(machine, mask);
+            }
+            if (recording != NULL) {
+                WriteKeyMask(recording, GetKeyMask(machine));
+            }
+            if (net != NULL) {
+                local_keys = GetKeyMask(machine);
+                if (!NetplayAdvance(net, machine, local_keys)) {
+                    exit_status = EXIT_FAILURE;
+                    halted = true;
+                    break;
+                }
+            } else if (debugger.armed) {
+                if (!DebuggerRunCycles(machine, machine->cycles_per_frame)) {
+                    halted = true;
+                    break;
+                }
+                if (machine->fault == FAULT_NONE) {
+                    TickTimers(machine);
+                }
+            } else if (config->trace == TRACE_INSTRUCTIONS) {
+                TraceCycles(machine, machine->cycles_per_frame);
+                if (machine->fault == FAULT_NONE) {
+                    TickTimers(machine);
+                }
+            } else {
+                RunFrame(machine, 0);
+            }
+            if (machine->fault != FAULT_NONE) {
+                fprintf(stderr, "%s: ", config->rom_path);
+                PrintFault(stderr, machine);
+                if (debugger.enabled) {
+                    // Leave the faulted state up for inspection before exiting.
+                    DebuggerConsole(machine, "fault");
+                }
+                exit_status = EXIT_FAILURE;
+                halted = true;
+                break;
+            }
+            ++frames;
+            ++batch;
+            if (config->trace >= TRACE_FRAMES) {
+                fprintf(stderr, "frame %lu: pc %03" PRIx16 " cycles %" PRIu64 " idle %" PRIu64 " keys %04" PRIx16 "\n",
+                        frames, machine->pc, machine->cycles, machine->idle_cycles, GetKeyMask(machine));
+            }
+            if (config->video_path != NULL) {
+                VideoStreamPush(&video, (const uint8_t*)machine->logical_pixels);
+            }
+            limit_reached = (config->frame_limit > 0 && frames >= config->frame_limit) || (config->cycle_limit > 0 && machine->cycles >= config->cycle_limit);
+        }
+        if (halted) {
+            break;
+        }
+        uint64_t emulated = NowNs();
+
+        if (snapshot_requested && config->snapshot_path != NULL) {
+            WriteFrame(config->snapshot_path, (const uint8_t*)machine->logical_pixels);
+        }
+        snapshot_requested = 0;
+
+        uint64_t rendered = emulated;
+        if (!config->headless) {
+            if (render_mode == RENDER_STREAMING) {
+                RenderStreaming(machine, config->decay);
+            } else {
+                Render(machine);
+            }
+            if (overlay_enabled) {
+                if (emulated - overlay_prev.ns >= METRICS_INTERVAL_NS) {
+                    MetricsTakeSample(&overlay_cur);
+                    MetricsCompute(&overlay_prev, &overlay_cur, &overlay_report);
+                    overlay_prev = overlay_cur;
+                }
+                DrawOverlay(&overlay_report);
+            }
+            rendered = NowNs();
+            SDL_RenderPresent(renderer);
+            uint64_t presented = NowNs();
+            FrameStatsRecord(&stats, machine, start, emulated, rendered, presented);
+            // With vsync, presenting already blocked until the display was ready.
+            if (!config->vsync && WaitForNextFrame(&deadline)) {
+                ++stats.late_frames;
+                MetricsAdd(&metrics.dropped_frames, 1);
+            } else if (due > 1) {
+                // Frames run to catch up on a slow display are never shown.
+                stats.late_frames += due - 1;
+                MetricsAdd(&metrics.dropped_frames, due - 1);
+            }
+        }
+        MetricsRecordFrame(machine->cycles - frame_start_cycles, NowNs() - start, input_done - start, emulated - input_done, rendered - emulated, machine->waiting_for_key);
+
+        if (limit_reached) {
+            break;
+        }
+    }
+    if (net != NULL && exit_status == EXIT_SUCCESS && !NetplayFinish(net, machine)) {
+        exit_status = EXIT_FAILURE;
     }
+    if (config->metrics_path != NULL) {
+        MetricsWriterClose(&metrics_writer);
+    }
+    FrameStatsReport(&stats);
 
-    SDL_Quit();
+    if (config->video_path != NULL) {
+        VideoStreamClose(&video);
+    }
+    if (config->snapshot_path != NULL) {
+        WriteFrame(config->snapshot_path, (const uint8_t*)machine->logical_pixels);
+    }
+    if (config->save_state_path != NULL && !SaveState(config->save_state_path, machine)) {
+        exit_status = EXIT_FAILURE;
+    }
+    if (recording != NULL) {
+        fclose(recording);
+    }
+    if (config->events_name != NULL) {
+        CloseEventRing(config->events_name, machine);
+    }
+    if (replay != NULL) {
+        fclose(replay);
+    }
+    if (!config->headless) {
+        SDL_Quit();
+    }
 
-    exit(EXIT_SUCCESS);
+    exit(exit_status);
 }